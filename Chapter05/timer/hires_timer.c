@@ -6,6 +6,13 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define MAX_CATCH_UP	16	/* missed periods recovered at each run */
+#define HIST_BUCKETS	32	/* jitter histogram size */
 
 /*
  * Module parameter and data
@@ -15,9 +22,32 @@ static int delay_ns = 1000000000;
 module_param(delay_ns, int, S_IRUSR | S_IWUSR);
 MODULE_PARM_DESC(delay_ns, "kernel timer delay is ns");
 
+static int slack_ns;
+module_param(slack_ns, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(slack_ns, "kernel timer slack in ns");
+
+static bool hard_timer;
+module_param(hard_timer, bool, S_IRUSR);
+MODULE_PARM_DESC(hard_timer, "run the kernel timer into hard IRQ context "
+			"(ignored on PREEMPT_RT)");
+
+static bool abs_timer;
+module_param(abs_timer, bool, S_IRUSR);
+MODULE_PARM_DESC(abs_timer, "align the kernel timer to multiples of delay_ns");
+
+static bool catch_up;
+module_param(catch_up, bool, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(catch_up, "take the samples of the missed periods too");
+
+static unsigned long overruns;
+module_param(overruns, ulong, S_IRUSR);
+MODULE_PARM_DESC(overruns, "number of missed periods (read-only)");
+
 static struct hires_timer_data {
 	struct hrtimer timer;
 	unsigned int data;
+	u64 hist[HIST_BUCKETS];	/* bucket i counts jitters < 2^(i + 1) ns */
+	struct dentry *debugfs;
 } hires_tinfo;
 
 /*
@@ -28,31 +58,139 @@ static enum hrtimer_restart hires_timer_handler(struct hrtimer *ptr)
 {
 	struct hires_timer_data *info = container_of(ptr,
 					struct hires_timer_data, timer);
+	int period = delay_ns;
+	ktime_t last;
+	s64 jitter;
+	u64 forwarded, missed, i;
+
+	/* Account how late we are into the jitter histogram */
+	jitter = ktime_to_ns(ktime_sub(ktime_get(),
+				hrtimer_get_softexpires(&info->timer)));
+	jitter = max_t(s64, jitter, 0);
+	info->hist[jitter < 2 ? 0 : min_t(unsigned int, ilog2(jitter),
+					HIST_BUCKETS - 1)]++;
+
+	/* Now forward the expiration time and ask to be rescheduled. The
+	 * timer may expire up to slack_ns later, so the kernel can serve
+	 * it together with other timers expiring into that range.
+	 *
+	 * Since the new expiration time is computed from the old one and
+	 * not from now, we do not drift; we also get how many periods
+	 * have been missed because the system was too loaded.
+	 *
+	 * hrtimer_forward_now() works on the hard expiration time, which
+	 * is slack_ns after the soft one, and we may run before it: then
+	 * nothing would be forwarded and we would fire again at once. So
+	 * the range is collapsed before forwarding and set again after.
+	 * If we still run early, nothing is forwarded and nothing missed.
+	 */
+	hrtimer_set_expires(&info->timer,
+			hrtimer_get_softexpires(&info->timer));
+	forwarded = hrtimer_forward_now(&info->timer, ns_to_ktime(period));
+	missed = forwarded ? forwarded - 1 : 0;
+	hrtimer_set_expires_range_ns(&info->timer,
+			hrtimer_get_softexpires(&info->timer), slack_ns);
+
+	if (missed) {
+		overruns += missed;
+		pr_warn("missed %llu periods\n", missed);
+		if (catch_up) {
+			/* Each missed sample belongs to its own period,
+			 * counted back from the last expiration
+			 */
+			last = ktime_sub_ns(hrtimer_get_softexpires(&info->timer),
+						period);
+			for (i = min_t(u64, missed, MAX_CATCH_UP); i > 0; i--)
+				pr_info("catch-up sample at %lld ns (data=%d)\n",
+					ktime_to_ns(ktime_sub_ns(last,
+							i * period)),
+					info->data++);
+		}
+	}
 
 	pr_info("kernel timer expired at %ld (data=%d)\n",
 				jiffies, info->data++);
 
-	/* Now forward the expiration time and ask to be rescheduled */
-	hrtimer_forward_now(&info->timer, ns_to_ktime(delay_ns));
 	return HRTIMER_RESTART;
 }
 
+/*
+ * debugfs methods: reading shows the jitter histogram and writing
+ * anything resets it
+ */
+
+static int hires_timer_show(struct seq_file *m, void *unused)
+{
+	struct hires_timer_data *info = m->private;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (info->hist[i])
+			seq_printf(m, "< %llu ns: %llu\n",
+					2ULL << i, info->hist[i]);
+
+	return 0;
+}
+
+static int hires_timer_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hires_timer_show, inode->i_private);
+}
+
+static ssize_t hires_timer_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct hires_timer_data *info = m->private;
+
+	memset(info->hist, 0, sizeof(info->hist));
+
+	return count;
+}
+
+static const struct file_operations hires_timer_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hires_timer_open,
+	.read		= seq_read,
+	.write		= hires_timer_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /*
  * Probe/remove functions
  */
 
 static int __init hires_timer_init(void)
 {
+	enum hrtimer_mode mode;
+	ktime_t expires = ns_to_ktime(delay_ns);
+
 	/* Set up hires timer delay */
 
-	pr_info("delay is set to %dns\n", delay_ns);
+	pr_info("delay is set to %dns (slack %dns)\n", delay_ns, slack_ns);
+
+	/* Absolute timers expire at the next multiple of the delay, hard
+	 * timers are served into IRQ context with a lower jitter. On
+	 * PREEMPT_RT kernels printk() may sleep, so we stay soft there.
+	 */
+	mode = abs_timer ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL;
+	if (hard_timer && !IS_ENABLED(CONFIG_PREEMPT_RT))
+		mode |= HRTIMER_MODE_HARD;
+	else
+		mode |= HRTIMER_MODE_SOFT;
+	if (abs_timer)
+		expires = ns_to_ktime((div64_u64(ktime_get_ns(), delay_ns) + 1) *
+					delay_ns);
+
+	/* A debugfs failure is not fatal, we just lose the histogram */
+	hires_tinfo.debugfs = debugfs_create_file(KBUILD_MODNAME, 0644, NULL,
+				&hires_tinfo, &hires_timer_fops);
 
 	/* Setup and start the hires timer */
-	hrtimer_init(&hires_tinfo.timer, CLOCK_MONOTONIC,
-				HRTIMER_MODE_REL | HRTIMER_MODE_SOFT);
+	hrtimer_init(&hires_tinfo.timer, CLOCK_MONOTONIC, mode);
 	hires_tinfo.timer.function = hires_timer_handler;
-	hrtimer_start(&hires_tinfo.timer, ns_to_ktime(delay_ns),
-				HRTIMER_MODE_REL | HRTIMER_MODE_SOFT);
+	hrtimer_start_range_ns(&hires_tinfo.timer, expires, slack_ns, mode);
 
 	pr_info("hires timer module loaded\n");
 	return 0;
@@ -61,6 +199,7 @@ static int __init hires_timer_init(void)
 static void __exit hires_timer_exit(void)
 {
 	hrtimer_cancel(&hires_tinfo.timer);
+	debugfs_remove(hires_tinfo.debugfs);
 
 	pr_info("hires timer module unloaded\n");
 }
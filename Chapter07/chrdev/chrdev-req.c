@@ -27,12 +27,10 @@ static int chrdev_req_probe(struct platform_device *pdev)
 	count = device_get_child_node_count(dev);
 	if (count == 0)
 		return -ENODEV;
-	if (count > MAX_DEVICES)
-		return -ENOMEM;
 
 	device_for_each_child_node(dev, child) {
 		const char *label;
-		unsigned int id, ro;
+		unsigned int id, ro, len = 0;
 
 		/*
 		 * Get device's properties
@@ -51,9 +49,11 @@ static int chrdev_req_probe(struct platform_device *pdev)
 			continue;
 		}
 		ro = fwnode_property_present(child, "read-only");
+		if (fwnode_property_present(child, "buffer-size"))
+			fwnode_property_read_u32(child, "buffer-size", &len);
 
 		/* Register the new chr device */
-		ret = chrdev_device_register(label, id, ro, owner, dev);
+		ret = chrdev_device_register(label, id, ro, len, owner, dev);
 		if (ret) {
 			dev_err(dev, "unable to register");
 		}
@@ -6,21 +6,785 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
 #include <linux/mman.h>
-
+#include <linux/mount.h>
+#include <linux/pseudo_fs.h>
+#include <linux/ktime.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 
 #include "chrdev.h"
 
+#define CHRDEV_FS_MAGIC		0x63686476	/* "chdv" */
+
+#define CREATE_TRACE_POINTS
+#include "chrdev_trace.h"
+
+/*
+ * Module parameter
+ */
+
+static int buf_len = DEF_BUF_LEN;
+module_param(buf_len, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(buf_len, "default buffer size in bytes (rounded up to pages)");
+
+static int max_devices = MAX_DEVICES;
+module_param(max_devices, int, S_IRUSR);
+MODULE_PARM_DESC(max_devices, "number of minor numbers to reserve");
+
 /*
  * Local variables
  */
 
 static dev_t chrdev_devt;
 static struct class *chrdev_class;
+static struct dentry *chrdev_debugfs_root;
+static struct vfsmount *chrdev_mnt;
+
+static DEFINE_IDR(chrdev_idr);
+static DEFINE_MUTEX(chrdev_idr_lock);
+
+/*
+ * Statistics functions
+ */
+
+static void chrdev_stats_get(struct chrdev_device *chrdev,
+				struct chrdev_stats *sum)
+{
+	const unsigned int n = sizeof(*sum) / sizeof(u64);
+	u64 *s = (u64 *) sum, *v;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		v = (u64 *) per_cpu_ptr(chrdev->stats, cpu);
+		for (i = 0; i < n; i++)
+			s[i] += v[i];
+	}
+}
+
+/*
+ * sysfs methods
+ */
+
+#define CHRDEV_STAT_ATTR(name)						\
+static ssize_t name##_show(struct device *dev,				\
+				struct device_attribute *attr, char *buf) \
+{									\
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);		\
+	struct chrdev_stats sum;					\
+									\
+	chrdev_stats_get(chrdev, &sum);					\
+	return sprintf(buf, "%llu\n", sum.name);			\
+}									\
+static DEVICE_ATTR_RO(name)
+
+CHRDEV_STAT_ATTR(read_bytes);
+CHRDEV_STAT_ATTR(write_bytes);
+CHRDEV_STAT_ATTR(read_calls);
+CHRDEV_STAT_ATTR(write_calls);
+CHRDEV_STAT_ATTR(short_reads);
+CHRDEV_STAT_ATTR(read_retries);
+CHRDEV_STAT_ATTR(mmap_faults);
+
+/*
+ * Class attributes
+ */
+
+static struct attribute *chrdev_stats_attrs[] = {
+	&dev_attr_read_bytes.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_read_calls.attr,
+	&dev_attr_write_calls.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_read_retries.attr,
+	&dev_attr_mmap_faults.attr,
+	NULL,
+};
+
+static const struct attribute_group chrdev_stats_group = {
+	.name = "stats",
+	.attrs = chrdev_stats_attrs,
+};
+
+static const struct attribute_group *chrdev_groups[] = {
+	&chrdev_stats_group,
+	NULL,
+};
+
+/*
+ * debugfs methods
+ */
+
+static int chrdev_stats_show(struct seq_file *m, void *unused)
+{
+	struct chrdev_device *chrdev = m->private;
+	struct chrdev_stats sum;
+
+	chrdev_stats_get(chrdev, &sum);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+	seq_printf(m, "read_calls: %llu\n", sum.read_calls);
+	seq_printf(m, "write_calls: %llu\n", sum.write_calls);
+	seq_printf(m, "short_reads: %llu\n", sum.short_reads);
+	seq_printf(m, "read_retries: %llu\n", sum.read_retries);
+	seq_printf(m, "mmap_faults: %llu\n", sum.mmap_faults);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(chrdev_stats);
+
+/*
+ * Buffer management functions
+ *
+ * A buffer is made of single pages, so that it can be several
+ * megabytes long without needing physically contiguous memory; the
+ * pages are then vmap()ed to get a linear kernel address for it.
+ *
+ * Each device has two buffers: the active one, which is what readers
+ * see at offsets [0, buf_len), and the shadow one, which writers can
+ * fill at offsets [buf_len, 2 * buf_len) by using write() or mmap().
+ * CHRDEV_IOC_COMMIT swaps them by just exchanging the pointers, so
+ * readers see the whole new content at once.
+ */
+
+static int chrdev_buf_alloc(struct chrdev_buffer *b, unsigned int nr_pages)
+{
+	unsigned int i;
+
+	b->pages = kvcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!b->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_pages; i++) {
+		b->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!b->pages[i])
+			goto free_pages;
+	}
+
+	b->buf = vmap(b->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!b->buf)
+		goto free_pages;
+
+	return 0;
+
+free_pages:
+	while (i--)
+		__free_page(b->pages[i]);
+	kvfree(b->pages);
+
+	return -ENOMEM;
+}
+
+static void chrdev_buf_free(struct chrdev_buffer *b, unsigned int nr_pages)
+{
+	unsigned int i;
+
+	vunmap(b->buf);
+	for (i = 0; i < nr_pages; i++)
+		__free_page(b->pages[i]);
+	kvfree(b->pages);
+}
+
+/* Make the shadow buffer a copy of the active one, so that writers can
+ * prepare the next generation by changing a few bytes only
+ */
+static void chrdev_snapshot(struct chrdev_device *chrdev)
+{
+	unsigned int seq;
+
+	down_write(&chrdev->swap_lock);
+	do {
+		seq = read_seqbegin(&chrdev->lock);
+		memcpy(chrdev->shadow->buf, chrdev->active->buf,
+					chrdev->buf_len);
+	} while (read_seqretry(&chrdev->lock, seq));
+	up_write(&chrdev->swap_lock);
+}
+
+/* Publish the shadow buffer as the new active one. Readers still
+ * copying from the old one see the seqlock changing and read again.
+ */
+static u64 chrdev_commit(struct chrdev_device *chrdev)
+{
+	struct chrdev_buffer *b;
+	u64 gen;
+
+	down_write(&chrdev->swap_lock);
+
+	/* Drop all the user mappings: writers must not touch the old
+	 * shadow pages anymore, and readers must see the new active ones.
+	 * Faults are stopped by swap_lock until we are done. All files
+	 * share our inode's mapping (see chrdev_open()), so this catches
+	 * the mappings made through any device node.
+	 */
+	unmap_mapping_range(chrdev->inode->i_mapping, 0, 0, 1);
+
+	write_seqlock(&chrdev->lock);
+	b = chrdev->active;
+	WRITE_ONCE(chrdev->active, chrdev->shadow);
+	chrdev->shadow = b;
+	gen = ++chrdev->gen;
+	write_sequnlock(&chrdev->lock);
+
+	up_write(&chrdev->swap_lock);
+
+	return gen;
+}
+
+static u64 chrdev_get_gen(struct chrdev_device *chrdev)
+{
+	unsigned int seq;
+	u64 gen;
+
+	do {
+		seq = read_seqbegin(&chrdev->lock);
+		gen = chrdev->gen;
+	} while (read_seqretry(&chrdev->lock, seq));
+
+	return gen;
+}
+
+/*
+ * Bulk operations functions
+ *
+ * Data are moved through a kernel bounce buffer, so that we never fault
+ * while holding the seqlock or swap_lock (see chrdev_write_iter()).
+ * The commands' arguments may grow at their end in future versions.
+ */
+
+/* Lock the buffer selected by flags against other writers and return
+ * it: the active one needs the seqlock, the shadow one just swap_lock
+ */
+static struct chrdev_buffer *chrdev_bulk_lock(struct chrdev_device *chrdev,
+				u32 flags)
+{
+	if (flags & CHRDEV_BULK_SHADOW) {
+		down_read(&chrdev->swap_lock);
+		return chrdev->shadow;
+	}
+	write_seqlock(&chrdev->lock);
+	return chrdev->active;
+}
+
+static void chrdev_bulk_unlock(struct chrdev_device *chrdev, u32 flags)
+{
+	if (flags & CHRDEV_BULK_SHADOW)
+		up_read(&chrdev->swap_lock);
+	else
+		write_sequnlock(&chrdev->lock);
+}
+
+/* Store the segments into the buffer selected by flags. The readers of
+ * the active buffer spin while we hold the seqlock, so we take it for
+ * CHRDEV_ATOMIC_MAX bytes at most at a time; swap_lock keeps commits
+ * away meanwhile. A NULL tmp means to fill the segments with value.
+ */
+static void chrdev_bulk_store(struct chrdev_device *chrdev, u32 flags,
+				char *tmp, int value,
+				struct chrdev_seg *segs, unsigned int nr_segs)
+{
+	struct chrdev_buffer *b;
+	unsigned int i = 0;
+	size_t off = 0, left, len;
+
+	if (flags & CHRDEV_BULK_SHADOW) {
+		b = chrdev_bulk_lock(chrdev, flags);
+		for (i = 0; i < nr_segs; i++) {
+			if (tmp) {
+				memcpy(b->buf + segs[i].offset, tmp,
+							segs[i].len);
+				tmp += segs[i].len;
+			} else
+				memset(b->buf + segs[i].offset, value,
+							segs[i].len);
+		}
+		chrdev_bulk_unlock(chrdev, flags);
+		return;
+	}
+
+	down_read(&chrdev->swap_lock);
+	while (i < nr_segs) {
+		write_seqlock(&chrdev->lock);
+		b = chrdev->active;
+		for (left = CHRDEV_ATOMIC_MAX; i < nr_segs && left; ) {
+			len = min_t(size_t, segs[i].len - off, left);
+			if (tmp) {
+				memcpy(b->buf + segs[i].offset + off, tmp, len);
+				tmp += len;
+			} else
+				memset(b->buf + segs[i].offset + off,
+							value, len);
+			off += len;
+			left -= len;
+			if (off == segs[i].len) {
+				off = 0;
+				i++;
+			}
+		}
+		write_sequnlock(&chrdev->lock);
+	}
+	up_read(&chrdev->swap_lock);
+}
+
+static int chrdev_bulk_args(void *args, size_t size,
+				void __user *uarg, unsigned int cmd)
+{
+	if (_IOC_SIZE(cmd) < size)
+		return -EINVAL;
+
+	return copy_struct_from_user(args, size, uarg, _IOC_SIZE(cmd));
+}
+
+static struct chrdev_seg *chrdev_bulk_segs(struct chrdev_device *chrdev,
+				struct chrdev_bulk *bulk, size_t *total)
+{
+	struct chrdev_seg *segs;
+	unsigned int i;
+
+	if (bulk->flags & ~CHRDEV_BULK_SHADOW ||
+	    !bulk->nr_segs || bulk->nr_segs > UIO_MAXIOV)
+		return ERR_PTR(-EINVAL);
+
+	segs = memdup_user(u64_to_user_ptr(bulk->segs),
+				array_size(bulk->nr_segs, sizeof(*segs)));
+	if (IS_ERR(segs))
+		return segs;
+
+	/* All segments must be into the buffer, and not too many */
+	*total = 0;
+	for (i = 0; i < bulk->nr_segs; i++) {
+		if (segs[i].offset > chrdev->buf_len ||
+		    segs[i].len > chrdev->buf_len - segs[i].offset)
+			goto einval;
+		*total += segs[i].len;
+		if (*total > chrdev->buf_len)
+			goto einval;
+	}
+
+	return segs;
+
+einval:
+	kfree(segs);
+
+	return ERR_PTR(-EINVAL);
+}
+
+/* Move the segments from the buffer into the bounce one */
+static void chrdev_bulk_copy(char *buf, char *tmp, struct chrdev_seg *segs,
+				unsigned int nr_segs)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_segs; i++) {
+		memcpy(tmp, buf + segs[i].offset, segs[i].len);
+		tmp += segs[i].len;
+	}
+}
+
+static long chrdev_bulk_readv(struct chrdev_device *chrdev,
+				struct chrdev_bulk *bulk)
+{
+	struct chrdev_seg *segs;
+	unsigned int i, seq;
+	size_t total;
+	char *tmp, *p;
+	long ret;
+
+	segs = chrdev_bulk_segs(chrdev, bulk, &total);
+	if (IS_ERR(segs))
+		return PTR_ERR(segs);
+	tmp = kvmalloc(total, GFP_KERNEL);
+	if (!tmp) {
+		ret = -ENOMEM;
+		goto free_segs;
+	}
+
+	/* Get all the segments at once, as read() does */
+	if (bulk->flags & CHRDEV_BULK_SHADOW) {
+		down_read(&chrdev->swap_lock);
+		chrdev_bulk_copy(chrdev->shadow->buf, tmp,
+					segs, bulk->nr_segs);
+		up_read(&chrdev->swap_lock);
+	} else
+		while (1) {
+			seq = read_seqbegin(&chrdev->lock);
+			chrdev_bulk_copy(READ_ONCE(chrdev->active)->buf, tmp,
+					segs, bulk->nr_segs);
+			if (!read_seqretry(&chrdev->lock, seq))
+				break;
+			chrdev_stat_inc(chrdev, read_retries);
+		}
+
+	/* Then return them to the user space */
+	ret = total;
+	for (i = 0, p = tmp; i < bulk->nr_segs; p += segs[i++].len)
+		if (copy_to_user(u64_to_user_ptr(segs[i].addr), p,
+					segs[i].len)) {
+			ret = -EFAULT;
+			break;
+		}
+	if (ret > 0)
+		chrdev_stat_add(chrdev, read_bytes, ret);
+	chrdev_stat_inc(chrdev, read_calls);
+
+	kvfree(tmp);
+free_segs:
+	kfree(segs);
+
+	return ret;
+}
+
+static long chrdev_bulk_writev(struct chrdev_device *chrdev,
+				struct chrdev_bulk *bulk)
+{
+	struct chrdev_seg *segs;
+	unsigned int i;
+	size_t total;
+	char *tmp, *p;
+	long ret;
+
+	segs = chrdev_bulk_segs(chrdev, bulk, &total);
+	if (IS_ERR(segs))
+		return PTR_ERR(segs);
+	tmp = kvmalloc(total, GFP_KERNEL);
+	if (!tmp) {
+		ret = -ENOMEM;
+		goto free_segs;
+	}
+
+	/* Get all the segments from the user space... */
+	for (i = 0, p = tmp; i < bulk->nr_segs; p += segs[i++].len)
+		if (copy_from_user(p, u64_to_user_ptr(segs[i].addr),
+					segs[i].len)) {
+			ret = -EFAULT;
+			goto free_tmp;
+		}
+
+	/* ... then store them at once, as write() does */
+	chrdev_bulk_store(chrdev, bulk->flags, tmp, 0, segs, bulk->nr_segs);
+
+	ret = total;
+	chrdev_stat_add(chrdev, write_bytes, total);
+	chrdev_stat_inc(chrdev, write_calls);
+
+free_tmp:
+	kvfree(tmp);
+free_segs:
+	kfree(segs);
+
+	return ret;
+}
+
+static long chrdev_bulk_fill(struct chrdev_device *chrdev,
+				struct chrdev_fill *fill)
+{
+	struct chrdev_seg seg;
+
+	if (fill->flags & ~CHRDEV_BULK_SHADOW ||
+	    fill->offset > chrdev->buf_len ||
+	    fill->len > chrdev->buf_len - fill->offset)
+		return -EINVAL;
+
+	seg.offset = fill->offset;
+	seg.len = fill->len;
+	chrdev_bulk_store(chrdev, fill->flags, NULL, fill->value & 0xff,
+				&seg, 1);
+
+	chrdev_stat_add(chrdev, write_bytes, fill->len);
+	chrdev_stat_inc(chrdev, write_calls);
+
+	return 0;
+}
+
+static long chrdev_bulk_cas64(struct chrdev_device *chrdev,
+				struct chrdev_cas *cas,
+				struct chrdev_cas __user *ucas)
+{
+	struct chrdev_buffer *b;
+	u64 prev;
+
+	if (cas->flags & ~CHRDEV_BULK_SHADOW || cas->reserved ||
+	    !IS_ALIGNED(cas->offset, sizeof(u64)) ||
+	    cas->offset > chrdev->buf_len - sizeof(u64))
+		return -EINVAL;
+
+	/* The buffer is page aligned, so the word is naturally aligned
+	 * and the operation is atomic against mmap() users too
+	 */
+	b = chrdev_bulk_lock(chrdev, cas->flags);
+	prev = cmpxchg64((u64 *) (b->buf + cas->offset), cas->old, cas->new);
+	chrdev_bulk_unlock(chrdev, cas->flags);
+
+	if (put_user(prev, &ucas->old))
+		return -EFAULT;
+
+	return prev == cas->old ? 0 : -EAGAIN;
+}
+
+/* The commands are matched regardless of their argument's size. As for
+ * write(), changing the buffers needs a file opened for writing.
+ */
+static long chrdev_bulk_ioctl(struct file *filp,
+				unsigned int cmd, void __user *uarg)
+{
+	struct chrdev_device *chrdev = filp->private_data;
+	bool writable = filp->f_mode & FMODE_WRITE;
+	union {
+		struct chrdev_bulk bulk;
+		struct chrdev_fill fill;
+		struct chrdev_cas cas;
+	} args;
+	int ret;
+
+	switch (cmd & ~IOCSIZE_MASK) {
+	case CHRDEV_IOC_READV & ~IOCSIZE_MASK:
+		ret = chrdev_bulk_args(&args.bulk, sizeof(args.bulk), uarg, cmd);
+		if (ret)
+			return ret;
+		return chrdev_bulk_readv(chrdev, &args.bulk);
+
+	case CHRDEV_IOC_WRITEV & ~IOCSIZE_MASK:
+		if (!writable)
+			return -EBADF;
+		if (chrdev->read_only)
+			return -EINVAL;
+		ret = chrdev_bulk_args(&args.bulk, sizeof(args.bulk), uarg, cmd);
+		if (ret)
+			return ret;
+		return chrdev_bulk_writev(chrdev, &args.bulk);
+
+	case CHRDEV_IOC_FILL & ~IOCSIZE_MASK:
+		if (!writable)
+			return -EBADF;
+		if (chrdev->read_only)
+			return -EINVAL;
+		ret = chrdev_bulk_args(&args.fill, sizeof(args.fill), uarg, cmd);
+		if (ret)
+			return ret;
+		return chrdev_bulk_fill(chrdev, &args.fill);
+
+	case CHRDEV_IOC_CAS64 & ~IOCSIZE_MASK:
+		if (!writable)
+			return -EBADF;
+		if (chrdev->read_only)
+			return -EINVAL;
+		ret = chrdev_bulk_args(&args.cas, sizeof(args.cas), uarg, cmd);
+		if (ret)
+			return ret;
+		return chrdev_bulk_cas64(chrdev, &args.cas, uarg);
 
-struct chrdev_device chrdev_array[MAX_DEVICES];
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
+/*
+ * dma-buf exporter functions
+ *
+ * A dma-buf shares the pages of one of our buffers and it holds a
+ * reference to the device, so the pages stay around until the last
+ * importer is gone even if the device is unregistered meanwhile.
+ */
+
+struct chrdev_dmabuf_priv {
+	struct chrdev_device *chrdev;
+	struct chrdev_buffer *b;
+};
+
+static struct sg_table *chrdev_dmabuf_map(struct dma_buf_attachment *attach,
+				enum dma_data_direction dir)
+{
+	struct chrdev_dmabuf_priv *priv = attach->dmabuf->priv;
+	struct chrdev_device *chrdev = priv->chrdev;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, priv->b->pages, chrdev->nr_pages,
+				0, chrdev->buf_len, GFP_KERNEL);
+	if (ret)
+		goto free_sgt;
+
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto free_table;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+
+	return ERR_PTR(ret);
+}
+
+static void chrdev_dmabuf_unmap(struct dma_buf_attachment *attach,
+				struct sg_table *sgt,
+				enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int chrdev_dmabuf_mmap(struct dma_buf *dmabuf,
+				struct vm_area_struct *vma)
+{
+	struct chrdev_dmabuf_priv *priv = dmabuf->priv;
+
+	return vm_map_pages(vma, priv->b->pages, priv->chrdev->nr_pages);
+}
+
+static void chrdev_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct chrdev_dmabuf_priv *priv = dmabuf->priv;
+
+	put_device(&priv->chrdev->dev);
+	kfree(priv);
+}
+
+static const struct dma_buf_ops chrdev_dmabuf_ops = {
+	.map_dma_buf	= chrdev_dmabuf_map,
+	.unmap_dma_buf	= chrdev_dmabuf_unmap,
+	.mmap		= chrdev_dmabuf_mmap,
+	.release	= chrdev_dmabuf_release,
+};
+
+/* The dma-buf can be written only if the file can, and the shadow
+ * buffer cannot be exported at all to readers
+ */
+static struct dma_buf *chrdev_dmabuf_export(struct file *filp, u32 flags)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct chrdev_device *chrdev = filp->private_data;
+	bool writable = filp->f_mode & FMODE_WRITE;
+	struct chrdev_dmabuf_priv *priv;
+	struct dma_buf *dmabuf;
+
+	if (flags & ~CHRDEV_BULK_SHADOW)
+		return ERR_PTR(-EINVAL);
+	if ((flags & CHRDEV_BULK_SHADOW) && !writable)
+		return ERR_PTR(-EBADF);
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return ERR_PTR(-ENOMEM);
+	priv->chrdev = chrdev;
+
+	/* The buffers' roles may be swapped under us, not their pages */
+	down_read(&chrdev->swap_lock);
+	priv->b = flags & CHRDEV_BULK_SHADOW ? chrdev->shadow : chrdev->active;
+	up_read(&chrdev->swap_lock);
+
+	exp_info.ops = &chrdev_dmabuf_ops;
+	exp_info.size = chrdev->buf_len;
+	exp_info.flags = writable && !chrdev->read_only ? O_RDWR : O_RDONLY;
+	exp_info.priv = priv;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		kfree(priv);
+		return dmabuf;
+	}
+	get_device(&chrdev->dev);
+
+	return dmabuf;
+}
+
+static long chrdev_dmabuf_ioctl(struct file *filp,
+				struct chrdev_dmabuf __user *uarg)
+{
+	struct chrdev_dmabuf args;
+	struct dma_buf *dmabuf;
+	long ret;
+	int fd;
+
+	if (copy_from_user(&args, uarg, sizeof(args)))
+		return -EFAULT;
+
+	dmabuf = chrdev_dmabuf_export(filp, args.flags);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	/* The fd is installed only once the user has got it, since
+	 * after that we cannot take it back
+	 */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto put_dmabuf;
+	}
+	args.fd = fd;
+	if (copy_to_user(uarg, &args, sizeof(args))) {
+		ret = -EFAULT;
+		goto put_fd;
+	}
+	fd_install(fd, dmabuf->file);
+
+	return 0;
+
+put_fd:
+	put_unused_fd(fd);
+put_dmabuf:
+	/* dma_buf_put() calls chrdev_dmabuf_release() */
+	dma_buf_put(dmabuf);
+
+	return ret;
+}
+
+/*
+ * mmap() management functions
+ *
+ * Pages are mapped lazily by the fault handler, so only the pages a
+ * process actually touches get mapped; MAP_POPULATE (or MAP_LOCKED)
+ * prefaults the whole range through the same handler. The active
+ * buffer's pages come first, then the shadow buffer's ones.
+ */
+
+static vm_fault_t chrdev_vm_fault(struct vm_fault *vmf)
+{
+	struct chrdev_device *chrdev = vmf->vma->vm_private_data;
+	pgoff_t pgoff = vmf->pgoff;
+	struct chrdev_buffer *b;
+	vm_fault_t ret;
+
+	/* vmf->pgoff already includes the mmap() offset */
+	if (pgoff >= 2 * chrdev->nr_pages)
+		return VM_FAULT_SIGBUS;
+	chrdev_stat_inc(chrdev, mmap_faults);
+
+	/* No swaps while we map the page, see chrdev_commit() */
+	down_read(&chrdev->swap_lock);
+	if (pgoff < chrdev->nr_pages)
+		b = chrdev->active;
+	else {
+		b = chrdev->shadow;
+		pgoff -= chrdev->nr_pages;
+	}
+	ret = vmf_insert_page(vmf->vma, vmf->address, b->pages[pgoff]);
+	up_read(&chrdev->swap_lock);
+
+	return ret;
+}
+
+static const struct vm_operations_struct chrdev_vm_ops = {
+	.fault		= chrdev_vm_fault,
+};
 
 /*
  * Methods
@@ -31,27 +795,25 @@ static int chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct chrdev_device *chrdev = filp->private_data;
 	size_t size = vma->vm_end - vma->vm_start;
 	phys_addr_t offset = (phys_addr_t) vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long pfn;
 
 	/* Does it even fit in phys_addr_t? */
 	if (offset >> PAGE_SHIFT != vma->vm_pgoff)
 		return -EINVAL;
 
-	/* We cannot mmap too big areas */
-	if ((offset > BUF_LEN) || (size > BUF_LEN - offset))
+	/* We cannot mmap too big areas (the shadow buffer included) */
+	if ((offset > 2 * chrdev->buf_len) ||
+	    (size > 2 * chrdev->buf_len - offset))
 		return -EINVAL;
 
-	/* Get the physical address belong the virtual kernel address */
-	pfn = virt_to_phys(chrdev->buf) >> PAGE_SHIFT;
-
-	dev_info(chrdev->dev, "mmap vma=%lx pfn=%lx size=%lx",
-			vma->vm_start, pfn, size);
+	dev_info(&chrdev->dev, "mmap vma=%lx pgoff=%lx size=%lx",
+			vma->vm_start, vma->vm_pgoff, size);
 
-	/* Remap-pfn-range will mark the range VM_IO */
-	if (remap_pfn_range(vma, vma->vm_start,
-			    pfn, size,
-			    vma->vm_page_prot))
-		return -EAGAIN;
+	/* Pages will be inserted at fault time by chrdev_vm_fault(), so
+	 * the area must be VM_MIXEDMAP and it cannot grow with mremap()
+	 */
+	vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &chrdev_vm_ops;
+	vma->vm_private_data = chrdev;
 
 	return 0;
 }
@@ -63,53 +825,86 @@ static long chrdev_ioctl(struct file *filp,
 	struct chrdev_info info;
 	void __user *uarg = (void __user *) arg;
 	int __user *iuarg = (int __user *) arg;
-	int ret;
+	u64 __user *u64uarg = (u64 __user *) arg;
+	u64 start = trace_chrdev_ioctl_enabled() ? ktime_get_ns() : 0;
+	long ret = 0;
 
 	/* Get some command information */
 	if (_IOC_TYPE(cmd) != CHRDEV_IOCTL_BASE) {
-		dev_err(chrdev->dev, "command %x is not for us!\n", cmd);
+		dev_err(&chrdev->dev, "command %x is not for us!\n", cmd);
 		return -EINVAL;
 	}
-	dev_info(chrdev->dev, "cmd nr=%d size=%d dir=%x\n",
-			_IOC_NR(cmd), _IOC_SIZE(cmd), _IOC_DIR(cmd));
 
 	switch (cmd) {
 	case CHRDEV_IOC_GETINFO:
-		dev_info(chrdev->dev, "CHRDEV_IOC_GETINFO\n");
-
 		strncpy(info.label, chrdev->label, NAME_LEN);
 		info.read_only = chrdev->read_only;
 
-		ret = copy_to_user(uarg, &info, sizeof(struct chrdev_info));
-		if (ret)
-			return -EFAULT;
+		if (copy_to_user(uarg, &info, sizeof(struct chrdev_info)))
+			ret = -EFAULT;
 
 		break;
 
 	case WDIOC_SET_RDONLY:
-		dev_info(chrdev->dev, "WDIOC_SET_RDONLY\n");
+		if (get_user(chrdev->read_only, iuarg))
+			ret = -EFAULT;
 
-		ret = get_user(chrdev->read_only, iuarg);
-		if (ret)
-			return -EFAULT;
+		break;
+
+	case CHRDEV_IOC_SNAPSHOT:
+		/* Readers cannot change what others see */
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			ret = -EBADF;
+			break;
+		}
+		if (chrdev->read_only) {
+			ret = -EINVAL;
+			break;
+		}
+		chrdev_snapshot(chrdev);
+
+		break;
+
+	case CHRDEV_IOC_COMMIT:
+		if (!(filp->f_mode & FMODE_WRITE)) {
+			ret = -EBADF;
+			break;
+		}
+		if (chrdev->read_only) {
+			ret = -EINVAL;
+			break;
+		}
+		if (put_user(chrdev_commit(chrdev), u64uarg))
+			ret = -EFAULT;
+
+		break;
+
+	case CHRDEV_IOC_GET_GEN:
+		if (put_user(chrdev_get_gen(chrdev), u64uarg))
+			ret = -EFAULT;
+
+		break;
+
+	case CHRDEV_IOC_EXPORT_DMABUF:
+		ret = chrdev_dmabuf_ioctl(filp, uarg);
 
 		break;
 
 	default:
-		return -ENOIOCTLCMD;
+		ret = chrdev_bulk_ioctl(filp, cmd, uarg);
 	}
 
-	return 0;
+	trace_chrdev_ioctl(chrdev->id, cmd, ret, start);
+
+	return ret;
 }
 
 static loff_t chrdev_llseek(struct file *filp, loff_t offset, int whence)
 {
 	struct chrdev_device *chrdev = filp->private_data;
+	u64 start = trace_chrdev_llseek_enabled() ? ktime_get_ns() : 0;
 	loff_t newppos;
 
-	dev_info(chrdev->dev, "should move *ppos=%lld by whence %d off=%lld\n",
-				filp->f_pos, whence, offset);
-
 	switch (whence) {
 	case SEEK_SET:
 		newppos = offset;
@@ -120,71 +915,155 @@ static loff_t chrdev_llseek(struct file *filp, loff_t offset, int whence)
 		break;
 
 	case SEEK_END:
-		newppos = BUF_LEN + offset;
+		newppos = chrdev->buf_len + offset;
 		break;
 
 	default:
-		return -EINVAL;
+		newppos = -EINVAL;
+		goto out;
 	}
 
-	if ((newppos < 0) || (newppos >= BUF_LEN))
-		return -EINVAL;
+	if ((newppos < 0) || (newppos >= 2 * chrdev->buf_len)) {
+		newppos = -EINVAL;
+		goto out;
+	}
 
 	filp->f_pos = newppos;
-	dev_info(chrdev->dev, "return *ppos=%lld\n", filp->f_pos);
+
+out:
+	trace_chrdev_llseek(chrdev->id, offset, whence, newppos, start);
 
 	return newppos;
 }
 
-static ssize_t chrdev_read(struct file *filp,
-			   char __user *buf, size_t count, loff_t *ppos)
+static ssize_t chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct chrdev_device *chrdev = filp->private_data;
-	int ret;
-
-	dev_info(chrdev->dev, "should read %ld bytes (*ppos=%lld)\n",
-				count, *ppos);
+	struct chrdev_device *chrdev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	u64 start = trace_chrdev_read_enabled() ? ktime_get_ns() : 0;
+	ssize_t ret = 0;
+	unsigned int seq;
+	size_t n;
 
 	/* Check for end-of-buffer */
-	if (*ppos + count >= BUF_LEN)
-		count = BUF_LEN - *ppos;
+	if (pos >= chrdev->buf_len)
+		goto out;
+	n = min_t(size_t, count, chrdev->buf_len - pos);
+
+	/* Return data to the user space, whatever the number of
+	 * segments of the iterator (read(), readv(), io_uring...), or to
+	 * a pipe for splice() and sendfile().
+	 *
+	 * Readers take no locks, so they never wait for each other: the
+	 * copy is validated by the seqlock instead and, if a writer
+	 * updated the buffer (or a commit swapped it) meanwhile, it is
+	 * done again. The shadow buffer cannot be read.
+	 */
+	while (1) {
+		seq = read_seqbegin(&chrdev->lock);
+		ret = copy_to_iter(READ_ONCE(chrdev->active)->buf + pos, n, to);
+		if (!read_seqretry(&chrdev->lock, seq))
+			break;
+		iov_iter_revert(to, ret);
+		chrdev_stat_inc(chrdev, read_retries);
+	}
+	if (ret == 0 && n) {
+		ret = -EFAULT;
+		goto out;
+	}
 
-	/* Return data to the user space */
-	ret = copy_to_user(buf, chrdev->buf + *ppos, count);
-	if (ret < 0)
-		return -EFAULT;
+	iocb->ki_pos += ret;
+	chrdev_stat_add(chrdev, read_bytes, ret);
+	if (ret < count)
+		chrdev_stat_inc(chrdev, short_reads);
 
-	*ppos += count;
-	dev_info(chrdev->dev, "return %ld bytes (*ppos=%lld)\n", count, *ppos);
+out:
+	chrdev_stat_inc(chrdev, read_calls);
+	trace_chrdev_read(chrdev->id, count, pos, ret, start);
 
-	return count;
+	return ret;
 }
 
-static ssize_t chrdev_write(struct file *filp,
-			    const char __user *buf, size_t count, loff_t *ppos)
+static ssize_t chrdev_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct chrdev_device *chrdev = filp->private_data;
-	int ret;
+	struct chrdev_device *chrdev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	u64 start = trace_chrdev_write_enabled() ? ktime_get_ns() : 0;
+	size_t len = chrdev->buf_len;
+	ssize_t ret = 0;
+	char *tmp;
+	size_t n;
+
+	if (chrdev->read_only) {
+		ret = -EINVAL;
+		goto out;
+	}
 
-	dev_info(chrdev->dev, "should write %ld bytes (*ppos=%lld)\n",
-				count, *ppos);
+	/* Check for end-of-buffer: the active buffer ends at len and the
+	 * shadow one at 2 * len
+	 */
+	if (pos >= 2 * len)
+		goto out;
+	n = min_t(size_t, count, (pos < len ? len : 2 * len) - pos);
+
+	/* Readers spin while we hold the seqlock, and a non-blocking
+	 * bounce buffer must come from kmalloc(), so these writes are
+	 * short ones if needed (see CHRDEV_ATOMIC_MAX)
+	 */
+	if (pos < len || iocb->ki_flags & IOCB_NOWAIT)
+		n = min_t(size_t, n, CHRDEV_ATOMIC_MAX);
+
+	/* Get data from the user space into a bounce buffer first, since
+	 * we cannot fault while holding the seqlock or swap_lock (the
+	 * user's memory may be a mapping of ours)...
+	 */
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		tmp = kmalloc(n, GFP_NOWAIT | __GFP_NOWARN);
+	else
+		tmp = kvmalloc(n, GFP_KERNEL);
+	if (!tmp) {
+		ret = iocb->ki_flags & IOCB_NOWAIT ? -EAGAIN : -ENOMEM;
+		goto out;
+	}
+	ret = copy_from_iter(tmp, n, from);
+	if (ret == 0 && n) {
+		ret = -EFAULT;
+		goto free_tmp;
+	}
 
-	if (chrdev->read_only)
-		return -EINVAL;
+	/* ... then publish them at once, so that readers see the whole
+	 * write or nothing of it. Note that mmap() users bypass all this.
+	 * The shadow buffer needs no seqlock since readers do not see it,
+	 * we just have to keep commits away.
+	 */
+	if (pos < len) {
+		write_seqlock(&chrdev->lock);
+		memcpy(chrdev->active->buf + pos, tmp, ret);
+		write_sequnlock(&chrdev->lock);
+	} else {
+		if (iocb->ki_flags & IOCB_NOWAIT) {
+			if (!down_read_trylock(&chrdev->swap_lock)) {
+				ret = -EAGAIN;
+				goto free_tmp;
+			}
+		} else
+			down_read(&chrdev->swap_lock);
+		memcpy(chrdev->shadow->buf + pos - len, tmp, ret);
+		up_read(&chrdev->swap_lock);
+	}
 
-	/* Check for end-of-buffer */
-	if (*ppos + count >= BUF_LEN)
-		count = BUF_LEN - *ppos;
+	iocb->ki_pos += ret;
+	chrdev_stat_add(chrdev, write_bytes, ret);
 
-	/* Get data from the user space */
-	ret = copy_from_user(chrdev->buf + *ppos, buf, count);
-	if (ret < 0)
-		return -EFAULT;
+free_tmp:
+	kvfree(tmp);
+out:
+	chrdev_stat_inc(chrdev, write_calls);
+	trace_chrdev_write(chrdev->id, count, pos, ret, start);
 
-	*ppos += count;
-	dev_info(chrdev->dev, "got %ld bytes (*ppos=%lld)\n", count, *ppos);
-
-	return count;
+	return ret;
 }
 
 static int chrdev_open(struct inode *inode, struct file *filp)
@@ -192,9 +1071,18 @@ static int chrdev_open(struct inode *inode, struct file *filp)
 	struct chrdev_device *chrdev = container_of(inode->i_cdev,
 						struct chrdev_device, cdev);
 	filp->private_data = chrdev;
-	kobject_get(&chrdev->dev->kobj);
 
-	dev_info(chrdev->dev, "chrdev (id=%d) opened\n", chrdev->id);
+	/* Each device node has its own inode, so use our own mapping
+	 * to keep track of all the device's user mappings together
+	 */
+	filp->f_mapping = chrdev->inode->i_mapping;
+
+	/* We never block (writes just fail with EAGAIN if they should),
+	 * so io_uring can issue I/O inline
+	 */
+	filp->f_mode |= FMODE_NOWAIT;
+
+	dev_info(&chrdev->dev, "chrdev (id=%d) opened\n", chrdev->id);
 
 	return 0;
 }
@@ -203,10 +1091,9 @@ static int chrdev_release(struct inode *inode, struct file *filp)
 {
 	struct chrdev_device *chrdev = container_of(inode->i_cdev,
 						struct chrdev_device, cdev);
-	kobject_put(&chrdev->dev->kobj);
 	filp->private_data = NULL;
 
-	dev_info(chrdev->dev, "chrdev (id=%d) released\n", chrdev->id);
+	dev_info(&chrdev->dev, "chrdev (id=%d) released\n", chrdev->id);
 
 	return 0;
 }
@@ -215,80 +1102,167 @@ static const struct file_operations chrdev_fops = {
 	.owner		= THIS_MODULE,
 	.mmap		= chrdev_mmap,
 	.unlocked_ioctl	= chrdev_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
 	.llseek		= chrdev_llseek,
-	.read		= chrdev_read,
-	.write		= chrdev_write,
+	.read_iter	= chrdev_read_iter,
+	.write_iter	= chrdev_write_iter,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.open		= chrdev_open,
 	.release	= chrdev_release
 };
 
+/*
+ * Pseudo filesystem
+ *
+ * It just provides each device with an anonymous inode, whose mapping
+ * is used by all the files opened on the device.
+ */
+
+static int chrdev_fs_init_fs_context(struct fs_context *fc)
+{
+	return init_pseudo(fc, CHRDEV_FS_MAGIC) ? 0 : -ENOMEM;
+}
+
+static struct file_system_type chrdev_fs_type = {
+	.name		= "chrdev",
+	.owner		= THIS_MODULE,
+	.init_fs_context = chrdev_fs_init_fs_context,
+	.kill_sb	= kill_anon_super,
+};
+
+/*
+ * Device instances management
+ *
+ * Each device is allocated at registration time and it is freed by
+ * chrdev_dev_release() when its last reference is dropped; since the
+ * cdev holds a reference to the device, this happens only when the
+ * last open file is closed.
+ */
+
+static void chrdev_dev_release(struct device *dev)
+{
+	struct chrdev_device *chrdev = container_of(dev,
+					struct chrdev_device, dev);
+	unsigned int i;
+
+	if (chrdev->inode)
+		iput(chrdev->inode);
+	free_percpu(chrdev->stats);
+	for (i = 0; i < ARRAY_SIZE(chrdev->bufs); i++)
+		if (chrdev->bufs[i].buf)
+			chrdev_buf_free(&chrdev->bufs[i], chrdev->nr_pages);
+	kfree(chrdev);
+}
+
 /*
  * Exported functions
  */
 
 int chrdev_device_register(const char *label, unsigned int id,
-				unsigned int read_only,
+				unsigned int read_only, size_t len,
 				struct module *owner, struct device *parent)
 {
 	struct chrdev_device *chrdev;
-	dev_t devt;
 	int ret;
 
 	/* First check if we are allocating a valid device... */
-	if (id >= MAX_DEVICES) {
+	if (id >= max_devices) {
 		pr_err("invalid id %d\n", id);
 		return -EINVAL;
 	}
-	chrdev = &chrdev_array[id];
+
+	chrdev = kzalloc(sizeof(*chrdev), GFP_KERNEL);
+	if (!chrdev)
+		return -ENOMEM;
+	device_initialize(&chrdev->dev);
+	chrdev->dev.release = chrdev_dev_release;
 
 	/* ... then check if we have not busy id */
-	if (chrdev->busy) {
-		pr_err("id %d\n is busy", id);
-		return -EBUSY;
+	mutex_lock(&chrdev_idr_lock);
+	ret = idr_alloc(&chrdev_idr, chrdev, id, id + 1, GFP_KERNEL);
+	mutex_unlock(&chrdev_idr_lock);
+	if (ret < 0) {
+		if (ret == -ENOSPC) {
+			pr_err("id %d is busy\n", id);
+			ret = -EBUSY;
+		}
+		put_device(&chrdev->dev);
+		return ret;
 	}
 
-	/* First try to allocate memory for internal buffer */
-	chrdev->buf = kzalloc(BUF_LEN, GFP_KERNEL);
-	if (!chrdev->buf) {
-		dev_err(chrdev->dev, "cannot allocate memory buffer!\n");
-		return -ENOMEM;
+	/* First try to allocate memory for internal buffers */
+	if (!len)
+		len = buf_len;
+	len = PAGE_ALIGN(len);
+	chrdev->buf_len = len;
+	chrdev->nr_pages = len >> PAGE_SHIFT;
+	ret = chrdev_buf_alloc(&chrdev->bufs[0], chrdev->nr_pages);
+	if (!ret)
+		ret = chrdev_buf_alloc(&chrdev->bufs[1], chrdev->nr_pages);
+	if (ret) {
+		pr_err("cannot allocate memory buffer!\n");
+		goto remove_id;
 	}
+	chrdev->active = &chrdev->bufs[0];
+	chrdev->shadow = &chrdev->bufs[1];
+
+	/* Then the inode holding the user mappings */
+	chrdev->inode = alloc_anon_inode(chrdev_mnt->mnt_sb);
+	if (IS_ERR(chrdev->inode)) {
+		ret = PTR_ERR(chrdev->inode);
+		chrdev->inode = NULL;
+		goto remove_id;
+	}
+
+	/* Then the per CPU statistics */
+	chrdev->stats = alloc_percpu(struct chrdev_stats);
+	if (!chrdev->stats) {
+		ret = -ENOMEM;
+		goto remove_id;
+	}
+
+	/* Init the chrdev data */
+	chrdev->id = id;
+	chrdev->read_only = read_only;
+	strncpy(chrdev->label, label, NAME_LEN);
+	seqlock_init(&chrdev->lock);
+	init_rwsem(&chrdev->swap_lock);
+
+	/* Create the device */
+	chrdev->dev.devt = MKDEV(MAJOR(chrdev_devt), id);
+	chrdev->dev.class = chrdev_class;
+	chrdev->dev.parent = parent;
+	dev_set_drvdata(&chrdev->dev, chrdev);
+	ret = dev_set_name(&chrdev->dev, "%s@%d", label, id);
+	if (ret)
+		goto remove_id;
 
-	/* Create the device and initialize its data */
 	cdev_init(&chrdev->cdev, &chrdev_fops);
 	chrdev->cdev.owner = owner;
 
-	devt = MKDEV(MAJOR(chrdev_devt), id);
-	ret = cdev_add(&chrdev->cdev, devt, 1);
+	ret = cdev_device_add(&chrdev->cdev, &chrdev->dev);
 	if (ret) {
 		pr_err("failed to add char device %s at %d:%d\n",
 				label, MAJOR(chrdev_devt), id);
-		goto kfree_buf;
-	}
-
-	chrdev->dev = device_create(chrdev_class, parent, devt, chrdev,
-				   "%s@%d", label, id);
-	if (IS_ERR(chrdev->dev)) {
-		pr_err("unable to create device %s\n", label);
-		ret = PTR_ERR(chrdev->dev);
-		goto del_cdev;
+		goto remove_id;
 	}
-	dev_set_drvdata(chrdev->dev, chrdev);
 
-	/* Init the chrdev data */
-	chrdev->id = id;
-	chrdev->read_only = read_only;
-	chrdev->busy = 1;
-	strncpy(chrdev->label, label, NAME_LEN);
+	/* A debugfs failure is not fatal, we just lose the stats file */
+	chrdev->debugfs = debugfs_create_file(dev_name(&chrdev->dev), 0444,
+				chrdev_debugfs_root, chrdev,
+				&chrdev_stats_fops);
 
-	dev_info(chrdev->dev, "chrdev %s with id %d added\n", label, id);
+	dev_info(&chrdev->dev, "chrdev %s with id %d added (buffer %zu bytes)\n",
+				label, id, chrdev->buf_len);
 
 	return 0;
 
-del_cdev:
-	cdev_del(&chrdev->cdev);
-kfree_buf:
-	kfree(chrdev->buf);
+remove_id:
+	mutex_lock(&chrdev_idr_lock);
+	idr_remove(&chrdev_idr, id);
+	mutex_unlock(&chrdev_idr_lock);
+	put_device(&chrdev->dev);
 
 	return ret;
 }
@@ -298,32 +1272,26 @@ int chrdev_device_unregister(const char *label, unsigned int id)
 {
 	struct chrdev_device *chrdev;
 
-	/* First check if we are deallocating a valid device... */
-	if (id >= MAX_DEVICES) {
-		pr_err("invalid id %d\n", id);
-		return -EINVAL;
-	}
-	chrdev = &chrdev_array[id];
-
-	/* ... then check if device is actualy allocated */
-	if (!chrdev->busy || strcmp(chrdev->label, label)) {
+	/* First check if device is actualy allocated */
+	mutex_lock(&chrdev_idr_lock);
+	chrdev = idr_find(&chrdev_idr, id);
+	if (!chrdev || strcmp(chrdev->label, label)) {
+		mutex_unlock(&chrdev_idr_lock);
 		pr_err("id %d is not busy or label %s is not known\n",
 						id, label);
 		return -EINVAL;
 	}
+	idr_remove(&chrdev_idr, id);
+	mutex_unlock(&chrdev_idr_lock);
 
-	/* Deinit the chrdev data */
-	chrdev->id = 0;
-	chrdev->busy = 0;
-
-	dev_info(chrdev->dev, "chrdev %s with id %d removed\n", label, id);
+	dev_info(&chrdev->dev, "chrdev %s with id %d removed\n", label, id);
 
-	/* Free allocated memory */
-	kfree(chrdev->buf);
-
-	/* Dealocate the device */
-	device_destroy(chrdev_class, chrdev->dev->devt);
-	cdev_del(&chrdev->cdev);
+	/* Dealocate the device; memory is freed by chrdev_dev_release()
+	 * as soon as the last open file is closed.
+	 */
+	debugfs_remove(chrdev->debugfs);
+	cdev_device_del(&chrdev->cdev, &chrdev->dev);
+	put_device(&chrdev->dev);
 
 	return 0;
 }
@@ -343,9 +1311,10 @@ static int __init chrdev_init(void)
 		pr_err("chrdev: failed to allocate class\n");
 		return -ENOMEM;
 	}
+	chrdev_class->dev_groups = chrdev_groups;
 
 	/* Allocate a region for character devices */
-	ret = alloc_chrdev_region(&chrdev_devt, 0, MAX_DEVICES, "chrdev");
+	ret = alloc_chrdev_region(&chrdev_devt, 0, max_devices, "chrdev");
 	if (ret < 0) {
 		pr_err("failed to allocate char device region\n");
 		goto remove_class;
@@ -353,8 +1322,21 @@ static int __init chrdev_init(void)
 
 	pr_info("got major %d\n", MAJOR(chrdev_devt));
 
+	/* Mount our pseudo filesystem for the devices' inodes */
+	chrdev_mnt = kern_mount(&chrdev_fs_type);
+	if (IS_ERR(chrdev_mnt)) {
+		pr_err("failed to mount pseudo filesystem\n");
+		ret = PTR_ERR(chrdev_mnt);
+		goto unregister_region;
+	}
+
+	/* Create the debugfs directory for the devices' statistics */
+	chrdev_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
 	return 0;
 
+unregister_region:
+	unregister_chrdev_region(chrdev_devt, max_devices);
 remove_class:
 	class_destroy(chrdev_class);
 
@@ -363,8 +1345,11 @@ remove_class:
 
 static void __exit chrdev_exit(void)
 {
-	unregister_chrdev_region(chrdev_devt, MAX_DEVICES);
+	debugfs_remove_recursive(chrdev_debugfs_root);
+	kern_unmount(chrdev_mnt);
+	unregister_chrdev_region(chrdev_devt, max_devices);
 	class_destroy(chrdev_class);
+	idr_destroy(&chrdev_idr);
 }
 
 module_init(chrdev_init);
@@ -373,3 +1358,4 @@ module_exit(chrdev_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rodolfo Giometti");
 MODULE_DESCRIPTION("chardev");
+MODULE_IMPORT_NS(DMA_BUF);
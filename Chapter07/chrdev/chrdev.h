@@ -3,27 +3,59 @@
  */
 
 #include <linux/cdev.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/rwsem.h>
 #include "chrdev_ioctl.h"
 
-#define MAX_DEVICES	8
+#define MAX_DEVICES	8	/* default number of minors */
 #define NAME_LEN	CHRDEV_NAME_LEN
-#define BUF_LEN		PAGE_SIZE
+#define DEF_BUF_LEN	PAGE_SIZE
 
 /*
  * Chrdev basic structs
  */
 
+/* Performance counters (all u64, kept per CPU) */
+struct chrdev_stats {
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 read_calls;
+	u64 write_calls;
+	u64 short_reads;
+	u64 read_retries;
+	u64 mmap_faults;
+};
+
+#define chrdev_stat_inc(chrdev, name)	this_cpu_inc((chrdev)->stats->name)
+#define chrdev_stat_add(chrdev, name, n) this_cpu_add((chrdev)->stats->name, n)
+
+/* A buffer: its pages and their linear mapping into the kernel */
+struct chrdev_buffer {
+	char *buf;
+	struct page **pages;
+};
+
 /* Main struct */
 struct chrdev_device {
 	char label[NAME_LEN];
-	unsigned int busy : 1;
-	char *buf;
+	struct chrdev_buffer bufs[2];
+	struct chrdev_buffer *active;	/* the buffer readers see */
+	struct chrdev_buffer *shadow;	/* the one writers can prepare */
+	size_t buf_len;
+	unsigned int nr_pages;
+	seqlock_t lock;		/* serializes writers, validates readers */
+	struct rw_semaphore swap_lock;	/* keeps shadow users from swaps */
+	u64 gen;		/* active buffer's generation */
+	struct inode *inode;	/* its mapping is shared by all files */
 	int read_only;
 
 	unsigned int id;
 	struct module *owner;
 	struct cdev cdev;
-	struct device *dev;
+	struct device dev;
+	struct chrdev_stats __percpu *stats;
+	struct dentry *debugfs;
 };
 
 /*
@@ -34,6 +66,6 @@ struct chrdev_device {
 #define to_chrdev_device(obj) container_of((obj), struct chrdev_device, class)
 
 extern int chrdev_device_register(const char *label, unsigned int id,
-				unsigned int read_only,
+				unsigned int read_only, size_t len,
 				struct module *owner, struct device *parent);
 extern int chrdev_device_unregister(const char *label, unsigned int id);
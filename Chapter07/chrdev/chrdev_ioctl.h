@@ -13,9 +13,212 @@ struct chrdev_info {
 	int read_only;
 };
 
+/*
+ * The ring control page (chrdev_irq only)
+ *
+ * It is mapped at offset 0 while the ring data are mapped read-only at
+ * offset <page size>. The consumer reads the data from tail up to head
+ * (both are offsets into the data area, which is size bytes long and
+ * size is a power of two), then it advances tail by storing it back with
+ * release semantic or by using CHRDEV_IOC_RING_ADVANCE. The producer
+ * increments seq each time it publishes new data and adds to lost the
+ * number of bytes it had to discard (or the number of records, in
+ * record mode).
+ *
+ * head is always less than size, while tail is a free-running counter:
+ * the kernel advances it without wrapping and masks it with size - 1
+ * before use, so the consumer must do the same.
+ *
+ * With the CHRDEV_OVERRUN_DROP_OLDEST policy the producer moves tail
+ * too, so the consumer must advance it with a compare-and-swap and, if
+ * that fails, consider the data just read as garbage. Since tail does
+ * not wrap, a producer moving it by a whole ring cannot be mistaken
+ * for no move at all.
+ *
+ * Every open file has its own read cursor, and tail and lost here belong
+ * to the first file that maps the control page; other files can still
+ * map the data and use CHRDEV_IOC_RING_ADVANCE and CHRDEV_IOC_RING_STATUS
+ * with their own cursor.
+ */
+
+struct chrdev_ring_ctrl {
+	__u32 head;		/* written by the kernel */
+	__u32 tail;		/* written by the consumer */
+	__u32 seq;		/* written by the kernel */
+	__u32 size;
+	__u64 lost;		/* written by the kernel */
+	__u32 mode;		/* written by the kernel */
+	__u32 clock;		/* clockid of the timestamps */
+	__u32 ts_nr;		/* entries into the timestamps array */
+	__u32 reserved;
+};
+
+/*
+ * The timestamps array (chrdev_irq only)
+ *
+ * It is mapped read-only just after the ring data and it holds the
+ * capture time of the last ts_nr batches: the batch that moved seq from
+ * s to s + 1 is described at index s % ts_nr. An entry is overwritten
+ * ts_nr batches later, so readers should check seq again after using it.
+ */
+
+struct chrdev_tstamp {
+	__u64 timestamp;	/* in ns */
+	__u32 pos;		/* batch start into the ring data */
+	__u32 len;		/* batch length */
+};
+
+/* Ring data formats (chrdev_irq only) */
+#define CHRDEV_MODE_STREAM		0	/* raw bytes */
+#define CHRDEV_MODE_RECORD		1	/* struct chrdev_record */
+
+/*
+ * In record mode each entry into the ring is a struct chrdev_record
+ * followed by len bytes of payload, padded up to CHRDEV_RECORD_ALIGN
+ * bytes, so the next record is CHRDEV_RECORD_SIZE(len) bytes after it.
+ * read() returns whole records only, as many as fit into the user's
+ * buffer, and it fails with EMSGSIZE if not even one fits.
+ */
+
+struct chrdev_record {
+	__u32 len;		/* payload length */
+	__u32 seq;		/* record sequence number */
+	__u64 timestamp;	/* in ns */
+};
+
+#define CHRDEV_RECORD_ALIGN		8
+#define CHRDEV_RECORD_SIZE(len)		\
+	((sizeof(struct chrdev_record) + (len) + CHRDEV_RECORD_ALIGN - 1) & \
+					~(CHRDEV_RECORD_ALIGN - 1))
+
+/* Ring overrun policies (chrdev_irq only) */
+#define CHRDEV_OVERRUN_DROP_NEWEST	0	/* discard new data */
+#define CHRDEV_OVERRUN_DROP_OLDEST	1	/* overwrite unread data */
+#define CHRDEV_OVERRUN_BLOCK		2	/* stop the producer */
+
+struct chrdev_ring_status {		/* per open file */
+	__u64 consumed;		/* bytes given back to the producer */
+	__u64 lost;		/* bytes (records) discarded by the producer */
+};
+
+/* Reader wakeup settings (chrdev_irq only) */
+struct chrdev_wakeup {
+	__u32 lowat;		/* wake up when at least lowat bytes... */
+	__u32 reserved;
+	__u64 timeout_ns;	/* ...or when data are older than this */
+};
+
+/*
+ * Double buffering (chrdev only)
+ *
+ * Readers see the active buffer at offsets [0, size), while writers can
+ * prepare the next content into the shadow buffer at [size, 2 * size),
+ * where size is the offset lseek(fd, 0, SEEK_END) returns, by using
+ * write() or mmap(). CHRDEV_IOC_SNAPSHOT copies the active buffer into
+ * the shadow one and CHRDEV_IOC_COMMIT swaps them, returning the new
+ * active buffer's generation number, so readers always see a whole
+ * generation. All the device mappings are dropped at commit time and
+ * they are faulted in again on the next access.
+ *
+ * Readers never see half of a write() into the active buffer, so such
+ * writes (and non-blocking writes into both buffers) are limited to
+ * CHRDEV_ATOMIC_MAX bytes at a time: bigger ones are short writes.
+ */
+
+#define CHRDEV_ATOMIC_MAX		16384
+
+/*
+ * Bulk operations (chrdev only)
+ *
+ * CHRDEV_IOC_READV and CHRDEV_IOC_WRITEV transfer a list of segments in
+ * one call and they are atomic with respect to read() and write(): a
+ * CHRDEV_IOC_READV never sees half of a write and a CHRDEV_IOC_WRITEV
+ * of up to CHRDEV_ATOMIC_MAX bytes is seen as a whole. Bigger ones are
+ * stored CHRDEV_ATOMIC_MAX bytes at a time, all into the same
+ * generation. Both return the number of bytes transferred, which
+ * cannot be more than the buffer size in total.
+ *
+ * CHRDEV_IOC_FILL sets a range to value (use 0 to clear it), with the
+ * same atomicity as CHRDEV_IOC_WRITEV, while
+ * CHRDEV_IOC_CAS64 compares the 64-bit word at offset (which must be 8
+ * bytes aligned) with old and, if they are equal, it stores new; it
+ * fails with EAGAIN otherwise, and in both cases old is updated with
+ * the word's previous value.
+ *
+ * Offsets are into the active buffer, or into the shadow one if the
+ * CHRDEV_BULK_SHADOW flag is set. Unknown flags are rejected.
+ *
+ * All structures have the same layout on 32 and 64-bit systems (user
+ * pointers are stored as __u64), and they may be extended at their end
+ * in the future: the kernel accepts bigger ones as long as the extra
+ * bytes are zero.
+ */
+
+#define CHRDEV_BULK_SHADOW		(1 << 0)
+
+struct chrdev_seg {
+	__u64 offset;		/* into the buffer */
+	__u64 len;
+	__u64 addr;		/* user buffer */
+};
+
+struct chrdev_bulk {
+	__u64 segs;		/* array of struct chrdev_seg */
+	__u32 nr_segs;
+	__u32 flags;
+};
+
+struct chrdev_fill {
+	__u64 offset;
+	__u64 len;
+	__u32 value;		/* the low byte only is used */
+	__u32 flags;
+};
+
+struct chrdev_cas {
+	__u64 offset;
+	__u64 old;		/* updated by the kernel */
+	__u64 new;
+	__u32 flags;
+	__u32 reserved;
+};
+
+/*
+ * dma-buf export (chrdev only)
+ *
+ * CHRDEV_IOC_EXPORT_DMABUF returns into fd a new dma-buf file sharing
+ * the active buffer's pages (or the shadow buffer's ones if the
+ * CHRDEV_BULK_SHADOW flag is set) with other drivers and with user
+ * space, which can mmap() it. The dma-buf keeps its pages after a
+ * CHRDEV_IOC_COMMIT, so it follows the buffer and not the role.
+ *
+ * The dma-buf is writable only if the device is and the file has been
+ * opened for writing, while exporting the shadow buffer needs such a
+ * file too (EBADF otherwise).
+ */
+
+struct chrdev_dmabuf {
+	__u32 flags;
+	__s32 fd;		/* returned by the kernel */
+};
+
 /*
  * The ioctl() commands
  */
 
 #define CHRDEV_IOC_GETINFO	_IOR(CHRDEV_IOCTL_BASE, 0, struct chrdev_info)
 #define WDIOC_SET_RDONLY	_IOW(CHRDEV_IOCTL_BASE, 1, int)
+#define CHRDEV_IOC_RING_ADVANCE	_IOW(CHRDEV_IOCTL_BASE, 2, __u32)
+#define CHRDEV_IOC_SET_OVERRUN	_IOW(CHRDEV_IOCTL_BASE, 3, int)
+#define CHRDEV_IOC_RING_STATUS	_IOR(CHRDEV_IOCTL_BASE, 4, \
+					struct chrdev_ring_status)
+#define CHRDEV_IOC_SET_WAKEUP	_IOW(CHRDEV_IOCTL_BASE, 5, struct chrdev_wakeup)
+#define CHRDEV_IOC_SNAPSHOT	_IO(CHRDEV_IOCTL_BASE, 6)
+#define CHRDEV_IOC_COMMIT	_IOR(CHRDEV_IOCTL_BASE, 7, __u64)
+#define CHRDEV_IOC_GET_GEN	_IOR(CHRDEV_IOCTL_BASE, 8, __u64)
+#define CHRDEV_IOC_READV	_IOW(CHRDEV_IOCTL_BASE, 9, struct chrdev_bulk)
+#define CHRDEV_IOC_WRITEV	_IOW(CHRDEV_IOCTL_BASE, 10, struct chrdev_bulk)
+#define CHRDEV_IOC_FILL		_IOW(CHRDEV_IOCTL_BASE, 11, struct chrdev_fill)
+#define CHRDEV_IOC_CAS64	_IOWR(CHRDEV_IOCTL_BASE, 12, struct chrdev_cas)
+#define CHRDEV_IOC_EXPORT_DMABUF _IOWR(CHRDEV_IOCTL_BASE, 13, \
+						struct chrdev_dmabuf)
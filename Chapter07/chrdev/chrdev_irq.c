@@ -7,205 +7,1987 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/hrtimer.h>
 #include <linux/poll.h>
+#include <linux/mman.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
+#include <linux/wait_bit.h>
 
 #include "chrdev_irq.h"
 
+#define CREATE_TRACE_POINTS
+#include "chrdev_irq_trace.h"
+
 /*
  * Module parameter
  */
 
-static int delay_ns = 1000000000;
-module_param(delay_ns, int, S_IRUSR | S_IWUSR);
-MODULE_PARM_DESC(delay_ns, "kernel timer delay is ns");
+/* The writable parameters used by the producers must stay in range */
+static int chrdev_param_set_min(const char *val,
+				const struct kernel_param *kp, int min)
+{
+	int n, ret;
+
+	ret = kstrtoint(val, 0, &n);
+	if (ret)
+		return ret;
+	if (n < min)
+		return -EINVAL;
+	WRITE_ONCE(*(int *) kp->arg, n);
+
+	return 0;
+}
+
+static int chrdev_param_set_slack(const char *val,
+				const struct kernel_param *kp)
+{
+	return chrdev_param_set_min(val, kp, 0);
+}
+
+static int chrdev_param_set_batch(const char *val,
+				const struct kernel_param *kp)
+{
+	return chrdev_param_set_min(val, kp, 1);
+}
+
+static const struct kernel_param_ops chrdev_slack_ops = {
+	.set	= chrdev_param_set_slack,
+	.get	= param_get_int,
+};
+
+static const struct kernel_param_ops chrdev_batch_ops = {
+	.set	= chrdev_param_set_batch,
+	.get	= param_get_int,
+};
+
+static int delay_ns = 1000000000;
+module_param(delay_ns, int, S_IRUSR);
+MODULE_PARM_DESC(delay_ns, "default kernel timer delay is ns (each device "
+			"can change it through its delay_ns attribute)");
+
+static int slack_ns;
+module_param_cb(slack_ns, &chrdev_slack_ops, &slack_ns, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(slack_ns, "kernel timer slack in ns");
+
+static bool hard_timer;
+module_param(hard_timer, bool, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(hard_timer, "run the kernel timer into hard IRQ context "
+			"(ignored on PREEMPT_RT)");
+
+static bool abs_timer;
+module_param(abs_timer, bool, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(abs_timer, "align the kernel timer to multiples of delay_ns");
+
+static bool catch_up;
+module_param(catch_up, bool, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(catch_up, "produce the data of the missed timer periods too");
+
+static int batch = 1;
+module_param_cb(batch, &chrdev_batch_ops, &batch, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(batch, "number of bytes produced at each timer tick (>= 1)");
+
+static int buf_len = DEF_BUF_LEN;
+module_param(buf_len, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(buf_len, "default buffer size (rounded up to a power of two)");
+
+static int producer_cpu = -1;
+module_param(producer_cpu, int, S_IRUSR | S_IWUSR);
+MODULE_PARM_DESC(producer_cpu, "default CPU for the producers (-1 means any)");
+
+static char *source = "timer";
+module_param(source, charp, S_IRUSR);
+MODULE_PARM_DESC(source, "default data source (timer, kthread or gpio)");
+
+static int gpio = -1;
+module_param(gpio, int, S_IRUSR);
+MODULE_PARM_DESC(gpio, "default GPIO line for the gpio source");
+
+static int max_devices = MAX_DEVICES;
+module_param(max_devices, int, S_IRUSR);
+MODULE_PARM_DESC(max_devices, "number of minor numbers to reserve");
+
+/*
+ * Local variables
+ */
+
+static dev_t chrdev_devt;
+static struct class *chrdev_class;
+static struct dentry *chrdev_debugfs_root;
+static LIST_HEAD(chrdev_ticks);
+static DEFINE_MUTEX(chrdev_ticks_lock);
+
+static DEFINE_IDR(chrdev_idr);
+static DEFINE_MUTEX(chrdev_idr_lock);
+
+/*
+ * Dummy function to generate data
+ *
+ * It fills the buffer with the 'A'...'Z' sequence copying whole chunks
+ * of it, so even a producer running at maximum rate costs little more
+ * than a memcpy(). Each device keeps its own position into the sequence,
+ * since producers of different devices may run concurrently.
+ */
+
+static void get_new_chars(struct chrdev_device *chrdev, char *dst, size_t n)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	unsigned int d = chrdev->next_char;
+	size_t len;
+
+	while (n) {
+		len = min_t(size_t, n, sizeof(alphabet) - 1 - d);
+		memcpy(dst, &alphabet[d], len);
+		dst += len;
+		n -= len;
+		d = (d + len) % (sizeof(alphabet) - 1);
+	}
+	chrdev->next_char = d;
+}
+
+/*
+ * Statistics functions
+ */
+
+static void chrdev_stats_get(struct chrdev_device *chrdev,
+				struct chrdev_stats *sum)
+{
+	const unsigned int n = sizeof(*sum) / sizeof(u64);
+	u64 *s = (u64 *) sum, *v;
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		v = (u64 *) per_cpu_ptr(chrdev->stats, cpu);
+		for (i = 0; i < n; i++)
+			s[i] += v[i];
+	}
+}
+
+/*
+ * sysfs methods
+ */
+
+#define CHRDEV_STAT_ATTR(name)						\
+static ssize_t name##_show(struct device *dev,				\
+				struct device_attribute *attr, char *buf) \
+{									\
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);		\
+	struct chrdev_stats sum;					\
+									\
+	chrdev_stats_get(chrdev, &sum);					\
+	return sprintf(buf, "%llu\n", sum.name);			\
+}									\
+static DEVICE_ATTR_RO(name)
+
+CHRDEV_STAT_ATTR(read_bytes);
+CHRDEV_STAT_ATTR(read_calls);
+CHRDEV_STAT_ATTR(short_reads);
+CHRDEV_STAT_ATTR(eagain);
+CHRDEV_STAT_ATTR(drops);
+CHRDEV_STAT_ATTR(wakeups);
+CHRDEV_STAT_ATTR(wait_ns);
+CHRDEV_STAT_ATTR(mmap_faults);
+CHRDEV_STAT_ATTR(overruns);
+
+/*
+ * Class attributes
+ */
+
+static struct attribute *chrdev_stats_attrs[] = {
+	&dev_attr_read_bytes.attr,
+	&dev_attr_read_calls.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_eagain.attr,
+	&dev_attr_drops.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_wait_ns.attr,
+	&dev_attr_mmap_faults.attr,
+	&dev_attr_overruns.attr,
+	NULL,
+};
+
+static const struct attribute_group chrdev_stats_group = {
+	.name = "stats",
+	.attrs = chrdev_stats_attrs,
+};
+
+/*
+ * debugfs methods
+ */
+
+static int chrdev_stats_show(struct seq_file *m, void *unused)
+{
+	struct chrdev_device *chrdev = m->private;
+	struct chrdev_stats sum;
+
+	chrdev_stats_get(chrdev, &sum);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "read_calls: %llu\n", sum.read_calls);
+	seq_printf(m, "short_reads: %llu\n", sum.short_reads);
+	seq_printf(m, "eagain: %llu\n", sum.eagain);
+	seq_printf(m, "drops: %llu\n", sum.drops);
+	seq_printf(m, "wakeups: %llu\n", sum.wakeups);
+	seq_printf(m, "wait_ns: %llu\n", sum.wait_ns);
+	seq_printf(m, "mmap_faults: %llu\n", sum.mmap_faults);
+	seq_printf(m, "overruns: %llu\n", sum.overruns);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(chrdev_stats);
+
+/* The latency histograms are printed as the non empty buckets followed
+ * by the percentiles (as bucket upper bounds); writing anything into the
+ * file resets them.
+ */
+
+static const char * const chrdev_lat_names[CHRDEV_LAT_NR] = {
+	[CHRDEV_LAT_JITTER]	= "jitter",
+	[CHRDEV_LAT_PRODUCE]	= "produce_to_wakeup",
+	[CHRDEV_LAT_WAKEUP]	= "wakeup_to_copy",
+};
+
+static u64 chrdev_lat_percentile(const u64 *hist, u64 total,
+				unsigned int permille)
+{
+	u64 limit = div_u64(total * permille + 999, 1000);
+	u64 sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < CHRDEV_LAT_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum >= limit)
+			break;
+	}
+
+	return 2ULL << i;
+}
+
+static int chrdev_latency_show(struct seq_file *m, void *unused)
+{
+	struct chrdev_device *chrdev = m->private;
+	u64 hist[CHRDEV_LAT_BUCKETS], total;
+	unsigned int type, i;
+	int cpu;
+
+	for (type = 0; type < CHRDEV_LAT_NR; type++) {
+		memset(hist, 0, sizeof(hist));
+		total = 0;
+		for_each_possible_cpu(cpu)
+			for (i = 0; i < CHRDEV_LAT_BUCKETS; i++)
+				hist[i] += per_cpu_ptr(chrdev->latency,
+						cpu)->hist[type][i];
+		for (i = 0; i < CHRDEV_LAT_BUCKETS; i++)
+			total += hist[i];
+
+		seq_printf(m, "%s: %llu samples\n", chrdev_lat_names[type],
+					total);
+		if (!total)
+			continue;
+		for (i = 0; i < CHRDEV_LAT_BUCKETS; i++)
+			if (hist[i])
+				seq_printf(m, "  < %llu ns: %llu\n",
+					2ULL << i, hist[i]);
+		seq_printf(m, "  p50 < %llu ns, p99 < %llu ns, "
+				"p999 < %llu ns\n",
+				chrdev_lat_percentile(hist, total, 500),
+				chrdev_lat_percentile(hist, total, 990),
+				chrdev_lat_percentile(hist, total, 999));
+	}
+
+	return 0;
+}
+
+static int chrdev_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, chrdev_latency_show, inode->i_private);
+}
+
+static ssize_t chrdev_latency_write(struct file *file,
+				const char __user *buf, size_t count,
+				loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct chrdev_device *chrdev = m->private;
+	int cpu;
+
+	/* Concurrent updates may survive, which is fine for statistics */
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(chrdev->latency, cpu), 0,
+					sizeof(struct chrdev_latency));
+
+	return count;
+}
+
+static const struct file_operations chrdev_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= chrdev_latency_open,
+	.read		= seq_read,
+	.write		= chrdev_latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Buffer management functions
+ *
+ * The buffer is made of single pages, so that it can be several
+ * megabytes long without needing physically contiguous memory; the
+ * pages are then vmap()ed to get a linear kernel address for it.
+ * An extra page holds the ring control data (see struct
+ * chrdev_ring_ctrl) so that it can be mapped into user space too, while
+ * the timestamps array (see struct chrdev_tstamp) takes a quarter of the
+ * data size, with a minimum of one page.
+ * All pages are taken from the NUMA node of the producer's CPU.
+ */
+
+static int chrdev_buf_alloc(struct chrdev_device *chrdev, size_t len, int node)
+{
+	unsigned int i, nr_pages = len >> PAGE_SHIFT;
+	unsigned int nr_ts_pages = max(nr_pages / 4, 1U);
+
+	chrdev->ctrl_page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+	if (!chrdev->ctrl_page)
+		return -ENOMEM;
+	chrdev->ctrl = page_address(chrdev->ctrl_page);
+
+	chrdev->pages = kvmalloc_node(array_size(nr_pages + nr_ts_pages,
+					sizeof(struct page *)),
+					GFP_KERNEL | __GFP_ZERO, node);
+	if (!chrdev->pages)
+		goto free_ctrl;
+
+	for (i = 0; i < nr_pages + nr_ts_pages; i++) {
+		chrdev->pages[i] = alloc_pages_node(node,
+						GFP_KERNEL | __GFP_ZERO, 0);
+		if (!chrdev->pages[i])
+			goto free_pages;
+	}
+
+	chrdev->buf = vmap(chrdev->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!chrdev->buf)
+		goto free_pages;
+	chrdev->ts = vmap(&chrdev->pages[nr_pages], nr_ts_pages,
+					VM_MAP, PAGE_KERNEL);
+	if (!chrdev->ts)
+		goto unmap_buf;
+	chrdev->nr_pages = nr_pages;
+	chrdev->nr_ts_pages = nr_ts_pages;
+	chrdev->buf_len = len;
+	chrdev->ts_nr = (nr_ts_pages << PAGE_SHIFT) /
+					sizeof(struct chrdev_tstamp);
+
+	chrdev->ctrl->size = len;
+	chrdev->ctrl->ts_nr = chrdev->ts_nr;
+
+	return 0;
+
+unmap_buf:
+	vunmap(chrdev->buf);
+	chrdev->buf = NULL;
+free_pages:
+	while (i--)
+		__free_page(chrdev->pages[i]);
+	kvfree(chrdev->pages);
+free_ctrl:
+	__free_page(chrdev->ctrl_page);
+
+	return -ENOMEM;
+}
+
+static void chrdev_buf_free(struct chrdev_device *chrdev)
+{
+	unsigned int i;
+
+	vunmap(chrdev->ts);
+	vunmap(chrdev->buf);
+	for (i = 0; i < chrdev->nr_pages + chrdev->nr_ts_pages; i++)
+		__free_page(chrdev->pages[i]);
+	kvfree(chrdev->pages);
+	__free_page(chrdev->ctrl_page);
+}
+
+/*
+ * Circular buffer management functions
+ *
+ * The buffer is a single-producer/multi-consumer ring: only the timer
+ * handler moves chrdev->head while each open file moves its own read
+ * cursor, so readers never steal data from each other. The producer
+ * can only use the space in front of the slowest cursor, whose position
+ * is saved into chrdev->tail so that new readers start from there.
+ *
+ * No lock is needed on the data path as long as each side publishes its
+ * own index with a release and reads the other one with an acquire (see
+ * Documentation/core-api/circular-buffers.rst); files_lock just keeps
+ * the files list stable. chrdev->buf_len must be a power of two so
+ * that the CIRC_*() macros can wrap with a mask.
+ *
+ * Since the control page can be written by user space through mmap(),
+ * ctrl->head is just a copy of chrdev->head for the consumer. The
+ * cursors are free-running u32 counters, masked on use only, so that
+ * the cmpxchg() of CHRDEV_OVERRUN_DROP_OLDEST (see below) can tell a
+ * cursor pushed forward by a whole ring from an untouched one.
+ */
+
+static inline size_t cbuf_tail(struct chrdev_device *chrdev, u32 *cursor)
+{
+	return READ_ONCE(*cursor) & (chrdev->buf_len - 1);
+}
+
+static inline size_t cbuf_count(struct chrdev_file *f)
+{
+	struct chrdev_device *chrdev = f->chrdev;
+
+	return CIRC_CNT(smp_load_acquire(&chrdev->head),
+			cbuf_tail(chrdev, f->cursor), chrdev->buf_len);
+}
+
+/* Copy n bytes into the ring at pos, wrapping at its end, and return the
+ * position just after them. A NULL src means new data from the device.
+ */
+static size_t cbuf_put(struct chrdev_device *chrdev, size_t pos,
+				const void *src, size_t n)
+{
+	size_t len = min(n, chrdev->buf_len - pos);
+
+	if (src) {
+		memcpy(&chrdev->buf[pos], src, len);
+		memcpy(&chrdev->buf[0], src + len, n - len);
+	} else {
+		get_new_chars(chrdev, &chrdev->buf[pos], len);
+		get_new_chars(chrdev, &chrdev->buf[0], n - len);
+	}
+
+	return (pos + n) & (chrdev->buf_len - 1);
+}
+
+static void cbuf_get(struct chrdev_device *chrdev, size_t pos,
+				void *dst, size_t n)
+{
+	size_t len = min(n, chrdev->buf_len - pos);
+
+	memcpy(dst, &chrdev->buf[pos], len);
+	memcpy(dst + len, &chrdev->buf[0], n - len);
+}
+
+/*
+ * Record mode functions
+ *
+ * In CHRDEV_MODE_RECORD the ring holds struct chrdev_record entries (see
+ * chrdev_ioctl.h) and consumers can only move by whole records. Since a
+ * cursor may have been scribbled by user space, the headers found at a
+ * cursor are checked against the available data before trusting them.
+ */
+
+/* Return how many bytes from tail on can be consumed without splitting
+ * a record and without exceeding count.
+ */
+static ssize_t cbuf_frame(struct chrdev_device *chrdev,
+				size_t head, size_t tail, size_t count)
+{
+	size_t avail = CIRC_CNT(head, tail, chrdev->buf_len);
+	size_t mask = chrdev->buf_len - 1;
+	struct chrdev_record rec;
+	size_t len = 0, rsize;
+
+	if (READ_ONCE(chrdev->mode) != CHRDEV_MODE_RECORD)
+		return min(count, avail);
+
+	while (len < avail) {
+		cbuf_get(chrdev, (tail + len) & mask, &rec, sizeof(rec));
+		if (rec.len > avail - len)
+			return -EIO;
+		rsize = CHRDEV_RECORD_SIZE(rec.len);
+		if (rsize > avail - len)
+			return -EIO;
+		if (rsize > count - len)
+			break;
+		len += rsize;
+	}
+
+	return (!len && avail) ? -EMSGSIZE : len;
+}
+
+/* Return the position of the first record starting at least n bytes
+ * after tail; garbage data make us skip everything up to head. The
+ * skipped data are returned into lost, counted in records (garbage
+ * counts as one) or in bytes in stream mode.
+ */
+static size_t cbuf_skip(struct chrdev_device *chrdev,
+				size_t head, size_t tail, size_t n,
+				size_t *lost)
+{
+	size_t avail = CIRC_CNT(head, tail, chrdev->buf_len);
+	size_t mask = chrdev->buf_len - 1;
+	struct chrdev_record rec;
+	size_t len = 0, rsize;
+
+	if (READ_ONCE(chrdev->mode) != CHRDEV_MODE_RECORD) {
+		*lost = n;
+		return (tail + n) & mask;
+	}
+
+	*lost = 0;
+	while (len < n) {
+		cbuf_get(chrdev, (tail + len) & mask, &rec, sizeof(rec));
+		if (rec.len > avail - len)
+			goto garbage;
+		rsize = CHRDEV_RECORD_SIZE(rec.len);
+		if (rsize > avail - len)
+			goto garbage;
+		len += rsize;
+		(*lost)++;
+	}
+
+	return (tail + len) & mask;
+
+garbage:
+	(*lost)++;
+
+	return head;
+}
+
+/*
+ * Wakeup management functions
+ *
+ * A reader is ready when at least lowat bytes are into its part of the
+ * ring or when its oldest data have waited for more than timeout_ns. The
+ * producer checks every reader after each run, so the timeout is
+ * honoured with the producer's period granularity.
+ *
+ * The settings are changed under files_lock, so the producer checks
+ * every reader against its latest ones, while the readers' lockless
+ * checks see either the old or the new value of each.
+ */
+
+static bool cbuf_ready(struct chrdev_file *f)
+{
+	size_t count = cbuf_count(f);
+	u64 timeout_ns = READ_ONCE(f->timeout_ns);
+
+	if (count >= READ_ONCE(f->lowat))
+		return true;
+
+	return count && timeout_ns &&
+		ktime_get_ns() - READ_ONCE(f->pending_since) >= timeout_ns;
+}
+
+/*
+ * Overrun management functions
+ *
+ * With CHRDEV_OVERRUN_DROP_OLDEST the producer makes room by moving the
+ * slowest cursors forward by itself, so both sides must update them with
+ * a cmpxchg(): a consumer whose cmpxchg() fails knows that the data it
+ * has just copied may have been overwritten. With CHRDEV_OVERRUN_BLOCK
+ * the producer stops its timer when the slowest reader has no space left
+ * and any consumer restarts it as soon as it frees some.
+ */
+
+static void chrdev_add_lost(struct chrdev_device *chrdev,
+				struct chrdev_file *f, size_t n)
+{
+	WRITE_ONCE(f->lost, f->lost + n);
+	if (f == chrdev->ctrl_owner)
+		WRITE_ONCE(chrdev->ctrl->lost, f->lost);
+}
+
+/* Return the space in front of a cursor; if drop_oldest is set the cursor
+ * is pushed forward to leave at least want bytes free and the skipped
+ * data are returned into lost (see cbuf_skip()).
+ */
+static size_t cbuf_cursor_space(struct chrdev_device *chrdev, u32 *cursor,
+				size_t head, size_t want, bool drop_oldest,
+				size_t *lost)
+{
+	size_t mask = chrdev->buf_len - 1;
+	size_t tail, space, pos;
+	u32 old, new;
+
+	*lost = 0;
+	for (;;) {
+		old = READ_ONCE(*cursor);
+		tail = old & mask;
+		space = CIRC_SPACE(head, tail, chrdev->buf_len);
+		if (!drop_oldest || space >= want)
+			return space;
+
+		pos = cbuf_skip(chrdev, head, tail, want - space, lost);
+		new = old + ((pos - tail) & mask);
+		if (cmpxchg(cursor, old, new) == old)
+			break;
+	}
+
+	return CIRC_SPACE(head, pos, chrdev->buf_len);
+}
+
+/* Return the space in front of the slowest reader and save its position
+ * into chrdev->tail. The largest amount of data skipped by a reader due
+ * to CHRDEV_OVERRUN_DROP_OLDEST is returned into lost. Must be called
+ * with files_lock held.
+ */
+static size_t cbuf_reserve(struct chrdev_device *chrdev, size_t head,
+				size_t want, int policy, size_t *lost)
+{
+	bool drop_oldest = policy == CHRDEV_OVERRUN_DROP_OLDEST;
+	size_t space, min_space = SIZE_MAX, skipped;
+	struct chrdev_file *f;
+
+	/* Without readers we just keep the most recent data */
+	if (list_empty(&chrdev->files))
+		return cbuf_cursor_space(chrdev, &chrdev->tail,
+					head, want, drop_oldest, lost);
+
+	*lost = 0;
+	list_for_each_entry(f, &chrdev->files, list) {
+		space = cbuf_cursor_space(chrdev, f->cursor,
+					head, want, drop_oldest, &skipped);
+		if (skipped) {
+			chrdev_add_lost(chrdev, f, skipped);
+			*lost = max(*lost, skipped);
+		}
+		min_space = min(min_space, space);
+	}
+	WRITE_ONCE(chrdev->tail,
+			(head + min_space + 1) & (chrdev->buf_len - 1));
+
+	return min_space;
+}
+
+static void chrdev_kick(struct chrdev_device *chrdev)
+{
+	const struct chrdev_source_ops *src;
+
+	/* The lock keeps the source from changing under us */
+	mutex_lock(&chrdev->source_lock);
+	src = chrdev->source;
+	if (test_and_clear_bit(CHRDEV_THROTTLED, &chrdev->flags) &&
+	    src && src->kick)
+		src->kick(chrdev);
+	mutex_unlock(&chrdev->source_lock);
+}
+
+static void chrdev_kick_work(struct work_struct *work)
+{
+	struct chrdev_device *chrdev = container_of(work,
+					struct chrdev_device, kick_work);
+
+	chrdev_kick(chrdev);
+}
+
+/* In nowait mode (i.e. io_uring) we must not sleep on source_lock nor
+ * wait for the producer CPU, so the kick is deferred to a work item.
+ */
+static void chrdev_unthrottle(struct chrdev_device *chrdev, bool nowait)
+{
+	/* Order the cursor update against the flag test, the producer
+	 * does the opposite in chrdev_produce(). The plain test avoids
+	 * dirtying the producer's cache line at each release.
+	 */
+	smp_mb();
+	if (!test_bit(CHRDEV_THROTTLED, &chrdev->flags))
+		return;
+
+	if (nowait)
+		schedule_work(&chrdev->kick_work);
+	else
+		chrdev_kick(chrdev);
+}
+
+static bool cbuf_release(struct chrdev_file *f, u32 old, size_t n,
+				bool nowait)
+{
+	struct chrdev_device *chrdev = f->chrdev;
+	u32 tail = old + n;
+
+	if (READ_ONCE(chrdev->policy) == CHRDEV_OVERRUN_DROP_OLDEST) {
+		if (cmpxchg(f->cursor, old, tail) != old)
+			return false;
+	} else
+		smp_store_release(f->cursor, tail);
+
+	f->consumed += n;
+	chrdev_unthrottle(chrdev, nowait);
+
+	return true;
+}
+
+static void chrdev_set_policy(struct chrdev_device *chrdev, int policy)
+{
+	WRITE_ONCE(chrdev->policy, policy);
+
+	/* A stopped producer must be restarted if we leave block mode */
+	if (policy != CHRDEV_OVERRUN_BLOCK)
+		chrdev_unthrottle(chrdev, false);
+}
+
+/*
+ * Timestamping functions
+ *
+ * Each batch gets the time it has been produced at, read from the clock
+ * selected through sysfs, so consumers can rebuild the timing of the
+ * data after any buffering delay.
+ */
+
+static const struct {
+	const char *name;
+	clockid_t id;
+} chrdev_clocks[] = {
+	{ "monotonic",		CLOCK_MONOTONIC },
+	{ "monotonic-raw",	CLOCK_MONOTONIC_RAW },
+	{ "realtime",		CLOCK_REALTIME },
+	{ "boottime",		CLOCK_BOOTTIME },
+	{ "tai",		CLOCK_TAI },
+};
+
+static u64 chrdev_timestamp(struct chrdev_device *chrdev)
+{
+	switch (READ_ONCE(chrdev->clock)) {
+	case CLOCK_MONOTONIC_RAW:
+		return ktime_get_raw_ns();
+	case CLOCK_REALTIME:
+		return ktime_get_real_ns();
+	case CLOCK_BOOTTIME:
+		return ktime_get_boottime_ns();
+	case CLOCK_TAI:
+		return ktime_get_clocktai_ns();
+	default:
+		return ktime_get_ns();
+	}
+}
+
+static void chrdev_set_clock(struct chrdev_device *chrdev, clockid_t clock)
+{
+	WRITE_ONCE(chrdev->clock, clock);
+	WRITE_ONCE(chrdev->ctrl->clock, clock);
+}
+
+/*
+ * Data production
+ *
+ * chrdev_produce() is called by the data source each time new data are
+ * ready, so it is the (simulation of) IRQ handler. The data are stamped
+ * age_ns nanoseconds before now, which is not zero for data the source
+ * should have produced earlier. It returns false when the source must
+ * stop until chrdev_unthrottle() kicks it again.
+ *
+ * It can run into hard IRQ, softirq or process context, according to the
+ * source, but never concurrently with itself.
+ */
+
+static bool chrdev_produce(struct chrdev_device *chrdev, u64 age_ns)
+{
+	const struct chrdev_source_ops *src = READ_ONCE(chrdev->source);
+	static const char pad[CHRDEV_RECORD_ALIGN];
+	struct chrdev_ring_ctrl *ctrl = chrdev->ctrl;
+	int policy = READ_ONCE(chrdev->policy);
+	int mode = READ_ONCE(chrdev->mode);
+	size_t size = chrdev->buf_len;
+	size_t head = chrdev->head;
+	u64 timestamp = chrdev_timestamp(chrdev) - age_ns;
+	struct chrdev_tstamp *ts;
+	struct chrdev_record rec;
+	size_t want, n, pos, lost;
+	struct chrdev_file *f;
+	unsigned long flags;
+	bool wake = false;
+	u32 seq;
+
+	/* Sources that cannot be stopped lose new data when full */
+	if (policy == CHRDEV_OVERRUN_BLOCK && !src->kick)
+		policy = CHRDEV_OVERRUN_DROP_NEWEST;
+
+	/* In record mode we produce one record per run, whose payload
+	 * length cycles from 1 to batch bytes; each record gets a new
+	 * sequence number even if dropped, so readers can spot gaps, but
+	 * a record held back in block mode keeps it for the next run.
+	 */
+	if (mode == CHRDEV_MODE_RECORD) {
+		rec.seq = chrdev->seq;
+		rec.len = min_t(size_t, 1 + rec.seq % READ_ONCE(batch),
+								size / 2);
+		want = CHRDEV_RECORD_SIZE(rec.len);
+	} else
+		want = min_t(size_t, READ_ONCE(batch), size - 1);
+
+	spin_lock_irqsave(&chrdev->files_lock, flags);
+
+	/* Now we should check if we have some space to save incoming
+	 * data, otherwise we have to apply the overrun policy. Records
+	 * are never split, and losses are counted in records for them.
+	 */
+	n = min(want, cbuf_reserve(chrdev, head, want, policy, &lost));
+	if (mode == CHRDEV_MODE_RECORD && n < want)
+		n = 0;
+	if (policy == CHRDEV_OVERRUN_DROP_NEWEST)
+		lost = mode == CHRDEV_MODE_RECORD ? !n : want - n;
+	if (mode == CHRDEV_MODE_RECORD && (n || lost))
+		chrdev->seq++;
+
+	/* The reserved space is beyond head, where no reader can look
+	 * at, and the readers' cursors have already been moved past it,
+	 * so we can fill it without holding the lock.
+	 */
+	if (n) {
+		spin_unlock_irqrestore(&chrdev->files_lock, flags);
+
+		/* Fill up to the end of the buffer and then wrap */
+		if (mode == CHRDEV_MODE_RECORD) {
+			rec.timestamp = timestamp;
+			pos = cbuf_put(chrdev, head, &rec, sizeof(rec));
+			pos = cbuf_put(chrdev, pos, NULL, rec.len);
+			cbuf_put(chrdev, pos, pad, n - sizeof(rec) - rec.len);
+		} else
+			cbuf_put(chrdev, head, NULL, n);
+
+		spin_lock_irqsave(&chrdev->files_lock, flags);
+
+		/* Record when the batch has been produced... */
+		seq = READ_ONCE(ctrl->seq);
+		ts = &chrdev->ts[seq & (chrdev->ts_nr - 1)];
+		ts->timestamp = timestamp;
+		ts->pos = head;
+		ts->len = n;
+
+		/* ... and publish the new data to the consumers */
+		WRITE_ONCE(ctrl->seq, seq + 1);
+		head = (head + n) & (size - 1);
+		smp_store_release(&chrdev->head, head);
+		smp_store_release(&ctrl->head, head);
+	}
+
+	/* Check which readers must be woken up: those having enough data
+	 * or waiting for too long. Discarded new data are lost by all.
+	 */
+	list_for_each_entry(f, &chrdev->files, list) {
+		/* Data into an empty part of the ring start a new wait */
+		if (n && cbuf_count(f) <= n)
+			WRITE_ONCE(f->pending_since, ktime_get_ns());
+		if (policy == CHRDEV_OVERRUN_DROP_NEWEST && lost)
+			chrdev_add_lost(chrdev, f, lost);
+		wake |= cbuf_ready(f);
+	}
+
+	spin_unlock_irqrestore(&chrdev->files_lock, flags);
+
+	/* Wake up any possible sleeping process */
+	if (wake) {
+		WRITE_ONCE(chrdev->wake_ns, ktime_get_ns());
+		wake_up_interruptible(&chrdev->queue);
+		kill_fasync(&chrdev->fasync_queue, SIGIO, POLL_IN);
+		chrdev_stat_inc(chrdev, wakeups);
+	}
+	if (lost)
+		chrdev_stat_add(chrdev, drops, lost);
+
+	/* In block mode we stop until the slowest consumer frees enough
+	 * space for a whole run. If it did so while we were setting the
+	 * flag, we go on.
+	 */
+	if (policy == CHRDEV_OVERRUN_BLOCK && n < want) {
+		set_bit(CHRDEV_THROTTLED, &chrdev->flags);
+		smp_mb__after_atomic();
+
+		spin_lock_irqsave(&chrdev->files_lock, flags);
+		n = cbuf_reserve(chrdev, head, want, policy, &lost);
+		spin_unlock_irqrestore(&chrdev->files_lock, flags);
+
+		if (n < want ||
+		    !test_and_clear_bit(CHRDEV_THROTTLED, &chrdev->flags))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Data sources
+ *
+ * The ring can be fed by different sources, each one calling
+ * chrdev_produce() from its own context:
+ *
+ * - "timer" runs every delay_ns nanoseconds into a (soft) hrtimer,
+ *   shared among devices with the same period. Each device has its
+ *   own period, set by the delay_ns attribute, and a new period moves
+ *   it onto a new tick;
+ * - "kthread" runs a kernel thread producing at maximum rate, which is
+ *   useful for benchmarking;
+ * - "gpio" produces at each rising edge of a GPIO line into a threaded
+ *   IRQ handler. A real interrupt cannot be stopped, so in block mode
+ *   new data are dropped when the ring is full.
+ *
+ * The producer is pinned on chrdev->cpu, if set. All operations are
+ * called with source_lock held.
+ */
+
+/* hrtimer source: devices are not driven by their own hrtimer but they
+ * are attached to a shared tick, that is an hrtimer feeding all the
+ * devices on the same CPU with the same period and timer mode. The
+ * hrtimer expiration is given a slack of slack_ns, so that the kernel
+ * can coalesce it with other timers, and the result is less timer
+ * interrupts.
+ *
+ * A throttled device leaves the tick's running list but it stays
+ * attached to it, and the tick stops when nobody is running.
+ *
+ * hrtimer_forward_now() keeps the expirations on the period's grid
+ * without drifting, and it tells us how many periods were missed since
+ * the last run (that is when the system is too loaded to sample at the
+ * requested rate). These overruns are accounted to each device and, if
+ * catch_up is set, their data are produced too (up to MAX_CATCH_UP
+ * periods at a time). With abs_timer the tick expires at multiples of
+ * its period, and with hard_timer it runs into hard IRQ context for a
+ * lower jitter (ignored on PREEMPT_RT kernels, where our spinlocks
+ * sleep).
+ *
+ * A pinned hrtimer runs on the CPU that armed it, so to move the tick on
+ * its CPU we have to arm it from there. If that CPU is not available we
+ * fall back to the current one.
+ */
+
+static enum hrtimer_restart chrdev_tick_handler(struct hrtimer *ptr)
+{
+	struct chrdev_tick *tick = container_of(ptr, struct chrdev_tick, timer);
+	struct chrdev_device *chrdev;
+	ktime_t now = ktime_get();
+	LIST_HEAD(pending);
+	unsigned long flags;
+	u64 forwarded, missed, runs, i;
+	s64 jitter, late;
+	bool restart, ok;
+
+	/* How late are we? */
+	jitter = ktime_to_ns(ktime_sub(now,
+				hrtimer_get_softexpires(&tick->timer)));
+	jitter = max_t(s64, jitter, 0);
+
+	/* Forward the expiration time first, so we know how many periods
+	 * we missed. It does not matter if we are not going to restart.
+	 * The forward starts from the hard expiration time, which is
+	 * slack_ns after the soft one, and we may run before it: then the
+	 * timer would not move and we would fire again at once. So the
+	 * slack range is collapsed first and set again afterwards. If we
+	 * still run early, nothing is forwarded and nothing missed.
+	 */
+	hrtimer_set_expires(&tick->timer,
+			hrtimer_get_softexpires(&tick->timer));
+	forwarded = hrtimer_forward_now(&tick->timer,
+				ns_to_ktime(tick->period_ns));
+	missed = forwarded ? forwarded - 1 : 0;
+	hrtimer_set_expires_range_ns(&tick->timer,
+			hrtimer_get_softexpires(&tick->timer), READ_ONCE(slack_ns));
+	runs = 1;
+	if (READ_ONCE(catch_up))
+		runs += min_t(u64, missed, MAX_CATCH_UP);
+
+	/* How late are we for the last expiration, the one just before
+	 * the new one? The data of the i-th missed period before it are
+	 * stamped with their own expiration time, i.e. late + i periods
+	 * ago, while the current data are stamped now as usual.
+	 */
+	late = ktime_to_ns(ktime_sub(now,
+			ktime_sub_ns(hrtimer_get_softexpires(&tick->timer),
+					tick->period_ns)));
+	late = max_t(s64, late, 0);
+
+	/* The devices are produced one at a time without holding the
+	 * lock, so they are moved from a pending list back to the running
+	 * one while we go. Since they are always on a list, kicks and
+	 * stops work as usual, but a stop must wait for the device we are
+	 * running, if any.
+	 */
+	spin_lock_irqsave(&tick->lock, flags);
+	list_splice_init(&tick->devices, &pending);
+	while (!list_empty(&pending)) {
+		chrdev = list_first_entry(&pending,
+				struct chrdev_device, tick_list);
+		list_move_tail(&chrdev->tick_list, &tick->devices);
+		tick->running = chrdev;
+		spin_unlock_irqrestore(&tick->lock, flags);
+
+		chrdev_lat_add(chrdev, CHRDEV_LAT_JITTER, jitter);
+		if (missed)
+			chrdev_stat_add(chrdev, overruns, missed);
+		for (i = runs, ok = true; ok && i--; )
+			ok = chrdev_produce(chrdev, i ?
+					late + i * tick->period_ns : 0);
+
+		spin_lock_irqsave(&tick->lock, flags);
+
+		/* A throttled device leaves the running list, unless it
+		 * has been unthrottled meanwhile: then its kick found it
+		 * still listed and did nothing.
+		 */
+		if (!ok && test_bit(CHRDEV_THROTTLED, &chrdev->flags))
+			list_del_init(&chrdev->tick_list);
+
+		/* From now on the device may be gone */
+		WRITE_ONCE(tick->running, NULL);
+		smp_mb();
+		wake_up_var(&tick->running);
+	}
+	restart = !list_empty(&tick->devices);
+	tick->armed = restart;
+	spin_unlock_irqrestore(&tick->lock, flags);
+
+	return restart ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+static void chrdev_tick_arm(void *info)
+{
+	struct chrdev_tick *tick = info;
+	enum hrtimer_mode mode = tick->mode;
+	ktime_t expires = ns_to_ktime(tick->period_ns);
+
+	/* Absolute ticks start at the next multiple of their period */
+	if (!(mode & HRTIMER_MODE_REL))
+		expires = ns_to_ktime((div64_u64(ktime_get_ns(),
+				tick->period_ns) + 1) * tick->period_ns);
+	if (tick->cpu >= 0)
+		mode |= HRTIMER_MODE_PINNED;
+	hrtimer_start_range_ns(&tick->timer, expires,
+				READ_ONCE(slack_ns), mode);
+}
+
+/* Put the device into the tick's running list and start the tick if
+ * it was stopped
+ */
+static void chrdev_timer_kick(struct chrdev_device *chrdev)
+{
+	struct chrdev_tick *tick = chrdev->tick;
+	bool arm;
+
+	spin_lock_irq(&tick->lock);
+	if (list_empty(&chrdev->tick_list))
+		list_add_tail(&chrdev->tick_list, &tick->devices);
+	arm = !tick->armed;
+	tick->armed = true;
+	spin_unlock_irq(&tick->lock);
+
+	if (!arm)
+		return;
+	if (tick->cpu < 0 ||
+	    smp_call_function_single(tick->cpu, chrdev_tick_arm, tick, 1))
+		chrdev_tick_arm(tick);
+}
+
+static struct chrdev_tick *chrdev_tick_get(int cpu, u64 period_ns,
+					enum hrtimer_mode mode)
+{
+	struct chrdev_tick *tick;
+
+	list_for_each_entry(tick, &chrdev_ticks, list)
+		if (tick->cpu == cpu && tick->mode == mode &&
+		    tick->period_ns == period_ns)
+			goto found;
+
+	tick = kzalloc_node(sizeof(*tick), GFP_KERNEL,
+				cpu >= 0 ? cpu_to_node(cpu) : NUMA_NO_NODE);
+	if (!tick)
+		return NULL;
+	hrtimer_init(&tick->timer, CLOCK_MONOTONIC, mode);
+	tick->timer.function = chrdev_tick_handler;
+	spin_lock_init(&tick->lock);
+	INIT_LIST_HEAD(&tick->devices);
+	tick->period_ns = period_ns;
+	tick->mode = mode;
+	tick->cpu = cpu;
+	list_add(&tick->list, &chrdev_ticks);
+
+found:
+	tick->users++;
+
+	return tick;
+}
+
+static void chrdev_tick_put(struct chrdev_tick *tick)
+{
+	if (--tick->users)
+		return;
+
+	hrtimer_cancel(&tick->timer);
+	list_del(&tick->list);
+	kfree(tick);
+}
+
+static int chrdev_timer_start(struct chrdev_device *chrdev)
+{
+	enum hrtimer_mode mode;
+	struct chrdev_tick *tick;
+
+	mode = abs_timer ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL;
+	if (hard_timer && !IS_ENABLED(CONFIG_PREEMPT_RT))
+		mode |= HRTIMER_MODE_HARD;
+	else
+		mode |= HRTIMER_MODE_SOFT;
+
+	mutex_lock(&chrdev_ticks_lock);
+	tick = chrdev_tick_get(chrdev->cpu, chrdev->delay_ns, mode);
+	mutex_unlock(&chrdev_ticks_lock);
+	if (!tick)
+		return -ENOMEM;
+
+	chrdev->tick = tick;
+	chrdev_timer_kick(chrdev);
+
+	return 0;
+}
+
+static void chrdev_timer_stop(struct chrdev_device *chrdev)
+{
+	struct chrdev_tick *tick = chrdev->tick;
+
+	/* Once out of the lists the handler cannot pick us up anymore,
+	 * but it may still be producing for us
+	 */
+	spin_lock_irq(&tick->lock);
+	list_del_init(&chrdev->tick_list);
+	spin_unlock_irq(&tick->lock);
+	wait_var_event(&tick->running, READ_ONCE(tick->running) != chrdev);
+
+	mutex_lock(&chrdev_ticks_lock);
+	chrdev_tick_put(tick);
+	mutex_unlock(&chrdev_ticks_lock);
+	chrdev->tick = NULL;
+}
+
+static const struct chrdev_source_ops chrdev_timer_ops = {
+	.name	= "timer",
+	.start	= chrdev_timer_start,
+	.stop	= chrdev_timer_stop,
+	.kick	= chrdev_timer_kick,
+};
+
+/* kthread source: when stalled the thread sleeps until kicked */
+
+static int chrdev_thread_fn(void *data)
+{
+	struct chrdev_device *chrdev = data;
+
+	while (!kthread_should_stop()) {
+		if (!chrdev_produce(chrdev, 0)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (test_bit(CHRDEV_THROTTLED, &chrdev->flags) &&
+			    !kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+		}
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int chrdev_thread_start(struct chrdev_device *chrdev)
+{
+	struct task_struct *task;
+
+	task = kthread_create_on_node(chrdev_thread_fn, chrdev, chrdev->node,
+					"chrdev_irq/%d", chrdev->id);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	if (chrdev->cpu >= 0)
+		kthread_bind(task, chrdev->cpu);
+	chrdev->thread = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+static void chrdev_thread_stop(struct chrdev_device *chrdev)
+{
+	kthread_stop(chrdev->thread);
+	chrdev->thread = NULL;
+}
+
+static void chrdev_thread_kick(struct chrdev_device *chrdev)
+{
+	wake_up_process(chrdev->thread);
+}
+
+static const struct chrdev_source_ops chrdev_thread_ops = {
+	.name	= "kthread",
+	.start	= chrdev_thread_start,
+	.stop	= chrdev_thread_stop,
+	.kick	= chrdev_thread_kick,
+};
+
+/* GPIO source: the line is set through the "gpio" attribute */
+
+static irqreturn_t chrdev_gpio_handler(int irq, void *dev_id)
+{
+	struct chrdev_device *chrdev = dev_id;
+
+	chrdev_produce(chrdev, 0);
+
+	return IRQ_HANDLED;
+}
+
+static int chrdev_gpio_start(struct chrdev_device *chrdev)
+{
+	int ret;
+
+	if (chrdev->gpio < 0)
+		return -EINVAL;
 
-/*
- * Local variables
+	ret = gpio_request_one(chrdev->gpio, GPIOF_IN, dev_name(&chrdev->dev));
+	if (ret) {
+		dev_err(&chrdev->dev, "failed to request GPIO %d\n",
+					chrdev->gpio);
+		return ret;
+	}
+
+	/* Now ask to the kernel to convert GPIO line into an IRQ line */
+	ret = gpio_to_irq(chrdev->gpio);
+	if (ret < 0) {
+		dev_err(&chrdev->dev, "failed to map GPIO to IRQ!\n");
+		goto free_gpio;
+	}
+	chrdev->irq = ret;
+
+	ret = request_threaded_irq(chrdev->irq, NULL, chrdev_gpio_handler,
+				IRQF_TRIGGER_RISING | IRQF_ONESHOT,
+				dev_name(&chrdev->dev), chrdev);
+	if (ret) {
+		dev_err(&chrdev->dev, "cannot register IRQ %d\n", chrdev->irq);
+		goto free_gpio;
+	}
+	if (chrdev->cpu >= 0)
+		irq_set_affinity_hint(chrdev->irq, cpumask_of(chrdev->cpu));
+
+	return 0;
+
+free_gpio:
+	gpio_free(chrdev->gpio);
+
+	return ret;
+}
+
+static void chrdev_gpio_stop(struct chrdev_device *chrdev)
+{
+	irq_set_affinity_hint(chrdev->irq, NULL);
+	free_irq(chrdev->irq, chrdev);
+	gpio_free(chrdev->gpio);
+}
+
+static const struct chrdev_source_ops chrdev_gpio_ops = {
+	.name	= "gpio",
+	.start	= chrdev_gpio_start,
+	.stop	= chrdev_gpio_stop,
+};
+
+static const struct chrdev_source_ops *chrdev_sources[] = {
+	&chrdev_timer_ops,
+	&chrdev_thread_ops,
+	&chrdev_gpio_ops,
+};
+
+static const struct chrdev_source_ops *chrdev_find_source(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chrdev_sources); i++)
+		if (sysfs_streq(name, chrdev_sources[i]->name))
+			return chrdev_sources[i];
+
+	return NULL;
+}
+
+static void chrdev_source_stop(struct chrdev_device *chrdev)
+{
+	if (chrdev->source)
+		chrdev->source->stop(chrdev);
+}
+
+static int chrdev_source_start(struct chrdev_device *chrdev)
+{
+	int ret;
+
+	if (!chrdev->source)
+		return 0;
+
+	clear_bit(CHRDEV_THROTTLED, &chrdev->flags);
+	ret = chrdev->source->start(chrdev);
+	if (ret) {
+		dev_err(&chrdev->dev, "cannot start source %s\n",
+					chrdev->source->name);
+		WRITE_ONCE(chrdev->source, NULL);
+	}
+
+	return ret;
+}
+
+/* Replace the current source; on error we try to keep the old one */
+static int chrdev_set_source(struct chrdev_device *chrdev,
+				const struct chrdev_source_ops *src)
+{
+	const struct chrdev_source_ops *old;
+	int ret;
+
+	mutex_lock(&chrdev->source_lock);
+	old = chrdev->source;
+	chrdev_source_stop(chrdev);
+
+	WRITE_ONCE(chrdev->source, src);
+	ret = chrdev_source_start(chrdev);
+	if (ret && old) {
+		WRITE_ONCE(chrdev->source, old);
+		chrdev_source_start(chrdev);
+	}
+	mutex_unlock(&chrdev->source_lock);
+
+	return ret;
+}
+
+/* The data format can be changed only when nobody is reading, and
+ * the ring is emptied since old data cannot be converted.
  */
+static int chrdev_set_mode(struct chrdev_device *chrdev, int mode)
+{
+	int ret = 0;
 
-static dev_t chrdev_devt;
-static struct class *chrdev_class;
+	mutex_lock(&chrdev->source_lock);
+	chrdev_source_stop(chrdev);
 
-struct chrdev_device chrdev_array[MAX_DEVICES];
+	spin_lock_irq(&chrdev->files_lock);
+	if (list_empty(&chrdev->files)) {
+		WRITE_ONCE(chrdev->mode, mode);
+		WRITE_ONCE(chrdev->ctrl->mode, mode);
+		chrdev->tail = chrdev->head;
+	} else
+		ret = -EBUSY;
+	spin_unlock_irq(&chrdev->files_lock);
+
+	chrdev_source_start(chrdev);
+	mutex_unlock(&chrdev->source_lock);
+
+	return ret;
+}
 
 /*
- * Dummy function to generate data
+ * sysfs methods
  */
 
-static char get_new_char(void)
+static const char * const chrdev_policy_names[] = {
+	[CHRDEV_OVERRUN_DROP_NEWEST]	= "drop-newest",
+	[CHRDEV_OVERRUN_DROP_OLDEST]	= "drop-oldest",
+	[CHRDEV_OVERRUN_BLOCK]		= "block",
+};
+
+static ssize_t overrun_policy_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", chrdev_policy_names[chrdev->policy]);
+}
+
+static ssize_t overrun_policy_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	static char d = 'A' - 1;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int ret;
 
-	if (++d == ('Z' + 1))
-		d = 'A';
+	ret = sysfs_match_string(chrdev_policy_names, buf);
+	if (ret < 0)
+		return ret;
 
-	return d;
+	chrdev_set_policy(chrdev, ret);
+
+	return count;
 }
+static DEVICE_ATTR_RW(overrun_policy);
 
-/*
- * Circular buffer management functions
- */
+static const char * const chrdev_mode_names[] = {
+	[CHRDEV_MODE_STREAM]	= "stream",
+	[CHRDEV_MODE_RECORD]	= "record",
+};
 
-static inline bool cbuf_is_empty(size_t head, size_t tail, size_t len)
+static ssize_t mode_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	return head == tail;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", chrdev_mode_names[chrdev->mode]);
 }
 
-static inline bool cbuf_is_full(size_t head, size_t tail, size_t len)
+static ssize_t mode_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	head = (head + 1) % len;
-	return head == tail;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int ret;
+
+	ret = sysfs_match_string(chrdev_mode_names, buf);
+	if (ret < 0)
+		return ret;
+
+	ret = chrdev_set_mode(chrdev, ret);
+
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(mode);
 
-static inline size_t cbuf_count_to_end(size_t head, size_t tail, size_t len)
+static ssize_t clock_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	if (head >= tail)
-		return head - tail;
-	else
-		return len - tail + head;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chrdev_clocks); i++)
+		if (chrdev_clocks[i].id == chrdev->clock)
+			return sprintf(buf, "%s\n", chrdev_clocks[i].name);
+
+	return -EINVAL;
+}
+
+static ssize_t clock_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chrdev_clocks); i++)
+		if (sysfs_streq(buf, chrdev_clocks[i].name)) {
+			chrdev_set_clock(chrdev, chrdev_clocks[i].id);
+			return count;
+		}
+
+	return -EINVAL;
+}
+static DEVICE_ATTR_RW(clock);
+
+static ssize_t cpu_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(chrdev->cpu));
+}
+
+static ssize_t cpu_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int cpu, ret;
+
+	ret = kstrtoint(buf, 10, &cpu);
+	if (ret)
+		return ret;
+	if (cpu < -1 || cpu >= (int) nr_cpu_ids ||
+	    (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+
+	/* Restart the producer on its new CPU. Note that the buffer
+	 * stays on the NUMA node chosen at registration time.
+	 */
+	mutex_lock(&chrdev->source_lock);
+	chrdev_source_stop(chrdev);
+	WRITE_ONCE(chrdev->cpu, cpu);
+	ret = chrdev_source_start(chrdev);
+	mutex_unlock(&chrdev->source_lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(cpu);
+
+static ssize_t numa_node_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", chrdev->node);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+static ssize_t source_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	const struct chrdev_source_ops *src = READ_ONCE(chrdev->source);
+
+	return sprintf(buf, "%s\n", src ? src->name : "none");
+}
+
+static ssize_t source_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	const struct chrdev_source_ops *src;
+	int ret;
+
+	src = chrdev_find_source(buf);
+	if (!src)
+		return -EINVAL;
+
+	ret = chrdev_set_source(chrdev, src);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(source);
+
+static ssize_t gpio_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", chrdev->gpio);
 }
 
-static inline size_t cbuf_space_to_end(size_t head, size_t tail, size_t len)
+static ssize_t gpio_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	if (head >= tail)
-		return len - head + tail - 1;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	int gpio, ret;
+
+	ret = kstrtoint(buf, 10, &gpio);
+	if (ret)
+		return ret;
+
+	/* The line cannot be changed while in use */
+	mutex_lock(&chrdev->source_lock);
+	if (chrdev->source == &chrdev_gpio_ops)
+		ret = -EBUSY;
 	else
-		return tail - head - 1;
+		chrdev->gpio = gpio;
+	mutex_unlock(&chrdev->source_lock);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(gpio);
+
+static ssize_t delay_ns_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", READ_ONCE(chrdev->delay_ns));
 }
 
-static inline void cbuf_pointer_move(size_t *ptr, size_t n, size_t len)
+static ssize_t delay_ns_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
 {
-	*ptr = (*ptr + n) % len;
+	struct chrdev_device *chrdev = dev_get_drvdata(dev);
+	u64 delay;
+	int ret;
+
+	ret = kstrtou64(buf, 10, &delay);
+	if (ret)
+		return ret;
+	if (!delay)
+		return -EINVAL;
+
+	/* The tick's period is fixed, so a running timer source must be
+	 * restarted to move the device onto a tick with the new period
+	 */
+	mutex_lock(&chrdev->source_lock);
+	if (chrdev->source == &chrdev_timer_ops) {
+		chrdev_source_stop(chrdev);
+		WRITE_ONCE(chrdev->delay_ns, delay);
+		ret = chrdev_source_start(chrdev);
+	} else
+		WRITE_ONCE(chrdev->delay_ns, delay);
+	mutex_unlock(&chrdev->source_lock);
+
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(delay_ns);
 
 /*
- * (simulation of) IRQ handler
+ * Class attributes
  */
 
-static enum hrtimer_restart chrdev_timer_handler(struct hrtimer *ptr)
-{
-	struct chrdev_device *chrdev = container_of(ptr,
-					struct chrdev_device, timer);
+static struct attribute *chrdev_attrs[] = {
+	&dev_attr_overrun_policy.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_clock.attr,
+	&dev_attr_cpu.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_source.attr,
+	&dev_attr_gpio.attr,
+	&dev_attr_delay_ns.attr,
+	NULL,
+};
 
-	/* Grab the lock */
-	spin_lock(&chrdev->lock);
+static const struct attribute_group chrdev_group = {
+	.attrs = chrdev_attrs,
+};
 
-	/* Now we should check if we have some space to
-	 * save incoming data, otherwise they must be dropped...
-	 */
-	if (!cbuf_is_full(chrdev->head, chrdev->tail, BUF_LEN)) {
-		chrdev->buf[chrdev->head] = get_new_char();
+static const struct attribute_group *chrdev_groups[] = {
+	&chrdev_group,
+	&chrdev_stats_group,
+	NULL,
+};
 
-		cbuf_pointer_move(&chrdev->head, 1, BUF_LEN);
-	}
+/*
+ * mmap() management functions
+ *
+ * Page offset 0 is the control page while the ring data start at page
+ * offset 1, followed by the timestamps array; data and timestamps pages
+ * are always mapped read-only.
+ */
 
-	/* Release the lock */
-	spin_unlock(&chrdev->lock);
+static vm_fault_t chrdev_vm_fault(struct vm_fault *vmf)
+{
+	struct chrdev_device *chrdev = vmf->vma->vm_private_data;
+	struct page *page;
 
-	/* Wake up any possible sleeping process */
-	wake_up_interruptible(&chrdev->queue);
-	kill_fasync(&chrdev->fasync_queue, SIGIO, POLL_IN);
+	if (vmf->pgoff == 0)
+		page = chrdev->ctrl_page;
+	else if (vmf->pgoff <= chrdev->nr_pages + chrdev->nr_ts_pages)
+		page = chrdev->pages[vmf->pgoff - 1];
+	else
+		return VM_FAULT_SIGBUS;
+	chrdev_stat_inc(chrdev, mmap_faults);
 
-	/* Now forward the expiration time and ask to be rescheduled */
-	hrtimer_forward_now(&chrdev->timer, ns_to_ktime(delay_ns));
-	return HRTIMER_RESTART;
+	return vmf_insert_page(vmf->vma, vmf->address, page);
 }
 
+static const struct vm_operations_struct chrdev_vm_ops = {
+	.fault		= chrdev_vm_fault,
+};
+
 /*
  * Methods
  */
 
+static int chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct chrdev_file *f = filp->private_data;
+	struct chrdev_device *chrdev = f->chrdev;
+	unsigned long pages = vma_pages(vma);
+	unsigned long nr_pages = 1 + chrdev->nr_pages + chrdev->nr_ts_pages;
+	int ret = 0;
+
+	/* We cannot mmap too big areas */
+	if ((vma->vm_pgoff >= nr_pages) ||
+	    (pages > nr_pages - vma->vm_pgoff))
+		return -EINVAL;
+
+	/* Only the control page can be written */
+	if (vma->vm_pgoff + pages > 1) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* The control page holds one cursor only, so just one file can
+	 * map it; from now on its reads go through ctrl->tail. We cannot
+	 * take f->mux here since readers may fault while holding it.
+	 */
+	if (vma->vm_pgoff == 0) {
+		spin_lock_irq(&chrdev->files_lock);
+		if (!chrdev->ctrl_owner) {
+			WRITE_ONCE(chrdev->ctrl->tail, f->tail);
+			WRITE_ONCE(chrdev->ctrl->lost, f->lost);
+			WRITE_ONCE(f->cursor, &chrdev->ctrl->tail);
+			chrdev->ctrl_owner = f;
+		} else if (chrdev->ctrl_owner != f)
+			ret = -EBUSY;
+		spin_unlock_irq(&chrdev->files_lock);
+		if (ret)
+			return ret;
+	}
+
+	dev_info(&chrdev->dev, "mmap vma=%lx pgoff=%lx pages=%lx",
+			vma->vm_start, vma->vm_pgoff, pages);
+
+	/* Pages will be inserted at fault time by chrdev_vm_fault() */
+	vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &chrdev_vm_ops;
+	vma->vm_private_data = chrdev;
+
+	return 0;
+}
+
+static long chrdev_ioctl(struct file *filp,
+			unsigned int cmd, unsigned long arg)
+{
+	struct chrdev_file *f = filp->private_data;
+	struct chrdev_device *chrdev = f->chrdev;
+	struct chrdev_ring_status status;
+	struct chrdev_wakeup wakeup;
+	void __user *uarg = (void __user *) arg;
+	u32 __user *u32uarg = (u32 __user *) arg;
+	int __user *iuarg = (int __user *) arg;
+	int policy;
+	u32 n, old;
+	int ret = 0;
+
+	/* Get some command information */
+	if (_IOC_TYPE(cmd) != CHRDEV_IOCTL_BASE) {
+		dev_err(&chrdev->dev, "command %x is not for us!\n", cmd);
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+	case CHRDEV_IOC_RING_ADVANCE:
+		if (get_user(n, u32uarg))
+			return -EFAULT;
+
+		/* Grab the mutex */
+		mutex_lock(&f->mux);
+
+		/* We cannot consume more data than available, nor split
+		 * a record
+		 */
+		old = READ_ONCE(*f->cursor);
+		ret = cbuf_frame(chrdev, smp_load_acquire(&chrdev->head),
+					old & (chrdev->buf_len - 1), n);
+		if (ret >= 0 && !cbuf_release(f, old, ret, false))
+			ret = -EAGAIN;
+		else if (ret > 0)
+			ret = 0;
+
+		/* Release the mutex */
+		mutex_unlock(&f->mux);
+
+		break;
+
+	case CHRDEV_IOC_SET_OVERRUN:
+		if (get_user(policy, iuarg))
+			return -EFAULT;
+		if (policy < CHRDEV_OVERRUN_DROP_NEWEST ||
+		    policy > CHRDEV_OVERRUN_BLOCK)
+			return -EINVAL;
+
+		chrdev_set_policy(chrdev, policy);
+
+		break;
+
+	case CHRDEV_IOC_SET_WAKEUP:
+		if (copy_from_user(&wakeup, uarg, sizeof(wakeup)))
+			return -EFAULT;
+
+		/* We cannot wait for more data than the ring can hold */
+		spin_lock_irq(&chrdev->files_lock);
+		WRITE_ONCE(f->lowat, clamp_t(size_t, wakeup.lowat, 1,
+					chrdev->buf_len - 1));
+		WRITE_ONCE(f->timeout_ns, wakeup.timeout_ns);
+		spin_unlock_irq(&chrdev->files_lock);
+
+		break;
+
+	case CHRDEV_IOC_RING_STATUS:
+		mutex_lock(&f->mux);
+		status.consumed = f->consumed;
+		status.lost = READ_ONCE(f->lost);
+		mutex_unlock(&f->mux);
+
+		if (copy_to_user(uarg, &status, sizeof(status)))
+			return -EFAULT;
+
+		break;
+
+	default:
+		return -ENOIOCTLCMD;
+	}
+
+	return ret;
+}
+
 static int chrdev_fasync(int fd, struct file *filp, int on)
 {
-	struct chrdev_device *chrdev = filp->private_data;
+	struct chrdev_file *f = filp->private_data;
+	struct chrdev_device *chrdev = f->chrdev;
 
         return fasync_helper(fd, filp, on, &chrdev->fasync_queue);
 }
 
 static __poll_t chrdev_poll(struct file *filp, poll_table *wait)
 {
-	struct chrdev_device *chrdev = filp->private_data;
+	struct chrdev_file *f = filp->private_data;
+	struct chrdev_device *chrdev = f->chrdev;
 	__poll_t mask = 0;
 
 	poll_wait(filp, &chrdev->queue, wait);
 
-	/* Grab the mutex */
-	mutex_lock(&chrdev->mux);
+	/* mmap() consumers may free space without telling us; the
+	 * producer stops again by itself if the slowest reader is still
+	 * behind. poll() may be called by io_uring, so don't sleep here.
+	 */
+	if (test_bit(CHRDEV_THROTTLED, &chrdev->flags) &&
+	    CIRC_SPACE(chrdev->head, cbuf_tail(chrdev, f->cursor),
+						chrdev->buf_len))
+		chrdev_unthrottle(chrdev, true);
 
-	if (!cbuf_is_empty(chrdev->head, chrdev->tail, BUF_LEN))
+	if (cbuf_ready(f))
 		mask |= EPOLLIN | EPOLLRDNORM;
 
-	/* Release the mutex */
-	mutex_unlock(&chrdev->mux);
-
 	return mask;
 }
 
-static ssize_t chrdev_read(struct file *filp,
-               char __user *buf, size_t count, loff_t *ppos)
+static ssize_t chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct chrdev_device *chrdev = filp->private_data;
-	unsigned long flags;
-	char tmp[256];
-	size_t n;
-	int ret;
-
-	dev_info(chrdev->dev, "should read %ld bytes\n", count);
-
-	/* Grab the mutex */
-	mutex_lock(&chrdev->mux);
+	struct file *filp = iocb->ki_filp;
+	struct chrdev_file *f = filp->private_data;
+	struct chrdev_device *chrdev = f->chrdev;
+	bool nowait = (filp->f_flags & O_NONBLOCK) ||
+				(iocb->ki_flags & IOCB_NOWAIT);
+	size_t count = iov_iter_count(to);
+	size_t size = chrdev->buf_len;
+	u64 start = trace_chrdev_irq_read_enabled() ? ktime_get_ns() : 0;
+	size_t head, tail, len, n;
+	ssize_t ret;
+	u32 old;
+	u64 t, wake, pending;
+
+	/* Grab the mutex: each file has its own cursor, so it just
+	 * serializes the threads sharing this file. In IOCB_NOWAIT mode
+	 * (i.e. io_uring) we must not sleep at all.
+	 */
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&f->mux)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	} else
+		mutex_lock(&f->mux);
 
-	/* Check for some data into read buffer */
-	if (filp->f_flags & O_NONBLOCK) {
-		if (cbuf_is_empty(chrdev->head, chrdev->tail, BUF_LEN)) {
+	/* Check for enough data into read buffer; non blocking readers
+	 * get whatever is available as for sockets' SO_RCVLOWAT
+	 */
+	if (nowait) {
+		if (!cbuf_count(f)) {
 			ret = -EAGAIN;
 			goto unlock;
 		}
-	} else if (wait_event_interruptible(chrdev->queue,
-		!cbuf_is_empty(chrdev->head, chrdev->tail, BUF_LEN))) {
-		count = -ERESTARTSYS;
-		goto unlock;
+	} else if (!cbuf_ready(f)) {
+		t = ktime_get_ns();
+		ret = wait_event_interruptible(chrdev->queue, cbuf_ready(f));
+		chrdev_stat_add(chrdev, wait_ns, ktime_get_ns() - t);
+		if (ret) {
+			ret = -ERESTARTSYS;
+			goto unlock;
+		}
 	}
 
-	/* Grab the lock */
-	spin_lock_irqsave(&chrdev->lock, flags);
-
-	/* Get data from the circular buffer */
-	n = cbuf_count_to_end(chrdev->head, chrdev->tail, BUF_LEN);
-	count = min(count, n);
-	memcpy(tmp, &chrdev->buf[chrdev->tail], count);
-
-	/* Release the lock */
-	spin_unlock_irqrestore(&chrdev->lock, flags);
+	/* Account, once per wakeup, how long the data waited for it and
+	 * how long we took to come and get them. All readers share the
+	 * last wakeup time, so for readers with different lowat settings
+	 * these are estimates.
+	 */
+	wake = READ_ONCE(chrdev->wake_ns);
+	pending = READ_ONCE(f->pending_since);
+	if (wake != f->wake_ns && wake >= pending) {
+		chrdev_lat_add(chrdev, CHRDEV_LAT_PRODUCE, wake - pending);
+		chrdev_lat_add(chrdev, CHRDEV_LAT_WAKEUP, ktime_get_ns() - wake);
+		f->wake_ns = wake;
+	}
 
-	/* Return data to the user space */
-	ret = copy_to_user(buf, tmp, count);
+	/* Get data from the circular buffer. The acquire pairs with the
+	 * producer's release so that the data are visible before head.
+	 */
+retry:
+	head = smp_load_acquire(&chrdev->head);
+	old = READ_ONCE(*f->cursor);
+	tail = old & (size - 1);
+	ret = cbuf_frame(chrdev, head, tail, count);
 	if (ret < 0) {
+		/* We may have parsed data overwritten by the producer */
+		if (READ_ONCE(*f->cursor) != old)
+			goto retry;
+		goto unlock;
+	}
+	len = ret;
+
+	/* Return data to the user space directly from the ring: first
+	 * up to the end of the buffer and then the wrapped part, if any.
+	 * The iterator spreads them over all the user's segments, or over
+	 * the pipe's pages for splice() and sendfile().
+	 */
+	n = min_t(size_t, len, CIRC_CNT_TO_END(head, tail, size));
+	ret = copy_to_iter(&chrdev->buf[tail], n, to);
+	if (ret == n)
+		ret += copy_to_iter(&chrdev->buf[0], len - n, to);
+	if (ret == 0 && len) {
 		ret = -EFAULT;
 		goto unlock;
 	}
 
-	/* Now we can safely move the tail pointer */
-	cbuf_pointer_move(&chrdev->tail, count, BUF_LEN);
-	dev_info(chrdev->dev, "return %ld bytes\n", count);
+	/* A fault in the middle of a record must not split it */
+	if (ret < len && READ_ONCE(chrdev->mode) == CHRDEV_MODE_RECORD) {
+		n = ret;
+		ret = cbuf_frame(chrdev, head, tail, n);
+		if (ret <= 0) {
+			iov_iter_revert(to, n);
+			ret = -EFAULT;
+			goto unlock;
+		}
+		iov_iter_revert(to, n - ret);
+	}
+
+	/* Now we can safely release the space to the producer; if it
+	 * has overwritten our data meanwhile, we have to read them again
+	 */
+	if (!cbuf_release(f, old, ret, iocb->ki_flags & IOCB_NOWAIT)) {
+		iov_iter_revert(to, ret);
+		goto retry;
+	}
+	chrdev_stat_add(chrdev, read_bytes, ret);
+	if (ret < count)
+		chrdev_stat_inc(chrdev, short_reads);
 
 unlock:
 	/* Release the mutex */
-	mutex_unlock(&chrdev->mux);
+	mutex_unlock(&f->mux);
 
-	return count;
+out:
+	chrdev_stat_inc(chrdev, read_calls);
+	if (ret == -EAGAIN)
+		chrdev_stat_inc(chrdev, eagain);
+	trace_chrdev_irq_read(chrdev->id, count, ret, start);
+
+	return ret;
 }
 
 static int chrdev_open(struct inode *inode, struct file *filp)
 {
 	struct chrdev_device *chrdev = container_of(inode->i_cdev,
 						struct chrdev_device, cdev);
-	filp->private_data = chrdev;
-	kobject_get(&chrdev->dev->kobj);
+	struct chrdev_file *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	f->chrdev = chrdev;
+	mutex_init(&f->mux);
+	f->cursor = &f->tail;
+	f->lowat = 1;
+
+	/* New readers start from the oldest data still into the ring. We
+	 * must disable the interrupts since the producer may run into
+	 * hard IRQ context.
+	 */
+	spin_lock_irq(&chrdev->files_lock);
+	f->tail = chrdev->tail;
+	f->pending_since = ktime_get_ns();
+	list_add(&f->list, &chrdev->files);
+	spin_unlock_irq(&chrdev->files_lock);
+
+	filp->private_data = f;
+
+	/* We support IOCB_NOWAIT, see chrdev_read_iter() */
+	filp->f_mode |= FMODE_NOWAIT;
 
-	dev_info(chrdev->dev, "chrdev (id=%d) opened\n", chrdev->id);
+	dev_info(&chrdev->dev, "chrdev (id=%d) opened\n", chrdev->id);
 
 	return 0;
 }
@@ -214,104 +1996,195 @@ static int chrdev_release(struct inode *inode, struct file *filp)
 {
 	struct chrdev_device *chrdev = container_of(inode->i_cdev,
 						struct chrdev_device, cdev);
-	kobject_put(&chrdev->dev->kobj);
+	struct chrdev_file *f = filp->private_data;
+
+	spin_lock_irq(&chrdev->files_lock);
+	list_del(&f->list);
+	if (chrdev->ctrl_owner == f)
+		chrdev->ctrl_owner = NULL;
+	spin_unlock_irq(&chrdev->files_lock);
+	kfree(f);
+
+	/* The slowest reader may be gone */
+	chrdev_unthrottle(chrdev, false);
+
 	filp->private_data = NULL;
 
-	dev_info(chrdev->dev, "chrdev (id=%d) released\n", chrdev->id);
+	dev_info(&chrdev->dev, "chrdev (id=%d) released\n", chrdev->id);
 
 	return 0;
 }
 
 static const struct file_operations chrdev_fops = {
 	.owner		= THIS_MODULE,
+	.mmap		= chrdev_mmap,
+	.unlocked_ioctl	= chrdev_ioctl,
 	.fasync		= chrdev_fasync,
 	.poll		= chrdev_poll,
 	.llseek		= no_llseek,
-	.read		= chrdev_read,
+	.read_iter	= chrdev_read_iter,
+	.splice_read	= generic_file_splice_read,
 	.open		= chrdev_open,
 	.release	= chrdev_release
 };
 
+/*
+ * Device instances management
+ *
+ * Each device is allocated at registration time and it is freed by
+ * chrdev_dev_release() when its last reference is dropped; since the
+ * cdev holds a reference to the device, this happens only when the
+ * last open file is closed.
+ */
+
+static void chrdev_dev_release(struct device *dev)
+{
+	struct chrdev_device *chrdev = container_of(dev,
+					struct chrdev_device, dev);
+
+	cancel_work_sync(&chrdev->kick_work);
+	free_percpu(chrdev->latency);
+	free_percpu(chrdev->stats);
+	if (chrdev->buf)
+		chrdev_buf_free(chrdev);
+	kfree(chrdev);
+}
+
 /*
  * Exported functions
  */
 
 int chrdev_device_register(const char *label, unsigned int id,
-				unsigned int read_only,
+				unsigned int read_only, size_t len,
 				struct module *owner, struct device *parent)
 {
+	const struct chrdev_source_ops *src;
 	struct chrdev_device *chrdev;
-	dev_t devt;
+	int node = NUMA_NO_NODE;
+	int cpu = producer_cpu;
 	int ret;
 
 	/* First check if we are allocating a valid device... */
-	if (id >= MAX_DEVICES) {
+	if (id >= max_devices) {
 		pr_err("invalid id %d\n", id);
 		return -EINVAL;
 	}
-	chrdev = &chrdev_array[id];
+	src = chrdev_find_source(source);
+	if (!src) {
+		pr_err("unknown data source %s\n", source);
+		return -EINVAL;
+	}
 
-	/* ... then check if we have not busy id */
-	if (chrdev->busy) {
-		pr_err("id %d\n is busy", id);
-		return -EBUSY;
+	/* ... then where it should live */
+	if (cpu >= (int) nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu))) {
+		pr_warn("CPU %d is not available, producer not pinned\n",
+						cpu);
+		cpu = -1;
 	}
+	if (cpu >= 0)
+		node = cpu_to_node(cpu);
 
-	/* First try to allocate memory for internal buffer */
-	chrdev->buf = kzalloc(BUF_LEN, GFP_KERNEL);
-	if (!chrdev->buf) {
-		dev_err(chrdev->dev, "cannot allocate memory buffer!\n");
+	chrdev = kzalloc_node(sizeof(*chrdev), GFP_KERNEL, node);
+	if (!chrdev)
 		return -ENOMEM;
-	}
+	chrdev->cpu = cpu;
+	chrdev->node = node;
+	device_initialize(&chrdev->dev);
+	chrdev->dev.release = chrdev_dev_release;
+	INIT_LIST_HEAD(&chrdev->tick_list);
+	INIT_WORK(&chrdev->kick_work, chrdev_kick_work);
 
-	/* Create the device and initialize its data */
-	cdev_init(&chrdev->cdev, &chrdev_fops);
-	chrdev->cdev.owner = owner;
+	/* ... then check if we have not busy id */
+	mutex_lock(&chrdev_idr_lock);
+	ret = idr_alloc(&chrdev_idr, chrdev, id, id + 1, GFP_KERNEL);
+	mutex_unlock(&chrdev_idr_lock);
+	if (ret < 0) {
+		if (ret == -ENOSPC) {
+			pr_err("id %d is busy\n", id);
+			ret = -EBUSY;
+		}
+		put_device(&chrdev->dev);
+		return ret;
+	}
 
-	devt = MKDEV(MAJOR(chrdev_devt), id);
-	ret = cdev_add(&chrdev->cdev, devt, 1);
+	/* First try to allocate memory for internal buffer */
+	if (!len)
+		len = buf_len;
+	len = roundup_pow_of_two(PAGE_ALIGN(len));
+	ret = chrdev_buf_alloc(chrdev, len, node);
 	if (ret) {
-		pr_err("failed to add char device %s at %d:%d\n",
-				label, MAJOR(chrdev_devt), id);
-		goto kfree_buf;
+		pr_err("cannot allocate memory buffer!\n");
+		goto remove_id;
 	}
 
-	chrdev->dev = device_create(chrdev_class, parent, devt, chrdev,
-				   "%s@%d", label, id);
-	if (IS_ERR(chrdev->dev)) {
-		pr_err("unable to create device %s\n", label);
-		ret = PTR_ERR(chrdev->dev);
-		goto del_cdev;
+	/* Then the per CPU statistics */
+	chrdev->stats = alloc_percpu(struct chrdev_stats);
+	chrdev->latency = alloc_percpu(struct chrdev_latency);
+	if (!chrdev->stats || !chrdev->latency) {
+		ret = -ENOMEM;
+		goto remove_id;
 	}
-	dev_set_drvdata(chrdev->dev, chrdev);
 
 	/* Init the chrdev data */
 	chrdev->id = id;
 	chrdev->read_only = read_only;
-	chrdev->busy = 1;
 	strncpy(chrdev->label, label, NAME_LEN);
-	mutex_init(&chrdev->mux);
-	spin_lock_init(&chrdev->lock);
 	init_waitqueue_head(&chrdev->queue);
-	chrdev->head = chrdev->tail = 0;
-	chrdev->fasync_queue = NULL;
+	spin_lock_init(&chrdev->files_lock);
+	INIT_LIST_HEAD(&chrdev->files);
+	chrdev->policy = CHRDEV_OVERRUN_DROP_NEWEST;
+	chrdev_set_clock(chrdev, CLOCK_MONOTONIC);
+	mutex_init(&chrdev->source_lock);
+	chrdev->gpio = gpio;
+	chrdev->delay_ns = max(delay_ns, 1);
+
+	/* Create the device */
+	chrdev->dev.devt = MKDEV(MAJOR(chrdev_devt), id);
+	chrdev->dev.class = chrdev_class;
+	chrdev->dev.parent = parent;
+	set_dev_node(&chrdev->dev, node);
+	dev_set_drvdata(&chrdev->dev, chrdev);
+	ret = dev_set_name(&chrdev->dev, "%s@%d", label, id);
+	if (ret)
+		goto remove_id;
 
-	/* Setup and start the hires timer */
-	hrtimer_init(&chrdev->timer, CLOCK_MONOTONIC,
-				HRTIMER_MODE_REL | HRTIMER_MODE_SOFT);
-	chrdev->timer.function = chrdev_timer_handler;
-	hrtimer_start(&chrdev->timer, ns_to_ktime(delay_ns),
-				HRTIMER_MODE_REL | HRTIMER_MODE_SOFT);
+	cdev_init(&chrdev->cdev, &chrdev_fops);
+	chrdev->cdev.owner = owner;
+
+	ret = cdev_device_add(&chrdev->cdev, &chrdev->dev);
+	if (ret) {
+		pr_err("failed to add char device %s at %d:%d\n",
+				label, MAJOR(chrdev_devt), id);
+		goto remove_id;
+	}
 
+	/* A debugfs failure is not fatal, we just lose the stats files */
+	chrdev->debugfs = debugfs_create_dir(dev_name(&chrdev->dev),
+				chrdev_debugfs_root);
+	debugfs_create_file("stats", 0444, chrdev->debugfs, chrdev,
+				&chrdev_stats_fops);
+	debugfs_create_file("latency", 0644, chrdev->debugfs, chrdev,
+				&chrdev_latency_fops);
+
+	/* Start the data source */
+	ret = chrdev_set_source(chrdev, src);
+	if (ret)
+		goto del_cdev;
 
-	dev_info(chrdev->dev, "chrdev %s with id %d added\n", label, id);
+	dev_info(&chrdev->dev,
+		"chrdev %s with id %d added (buffer %zu bytes, node %d)\n",
+				label, id, chrdev->buf_len, node);
 
 	return 0;
 
 del_cdev:
-	cdev_del(&chrdev->cdev);
-kfree_buf:
-	kfree(chrdev->buf);
+	debugfs_remove_recursive(chrdev->debugfs);
+	cdev_device_del(&chrdev->cdev, &chrdev->dev);
+remove_id:
+	mutex_lock(&chrdev_idr_lock);
+	idr_remove(&chrdev_idr, id);
+	mutex_unlock(&chrdev_idr_lock);
+	put_device(&chrdev->dev);
 
 	return ret;
 }
@@ -321,35 +2194,29 @@ int chrdev_device_unregister(const char *label, unsigned int id)
 {
 	struct chrdev_device *chrdev;
 
-	/* First check if we are deallocating a valid device... */
-	if (id >= MAX_DEVICES) {
-		pr_err("invalid id %d\n", id);
-		return -EINVAL;
-	}
-	chrdev = &chrdev_array[id];
-
-	/* ... then check if device is actualy allocated */
-	if (!chrdev->busy || strcmp(chrdev->label, label)) {
+	/* First check if device is actualy allocated */
+	mutex_lock(&chrdev_idr_lock);
+	chrdev = idr_find(&chrdev_idr, id);
+	if (!chrdev || strcmp(chrdev->label, label)) {
+		mutex_unlock(&chrdev_idr_lock);
 		pr_err("id %d is not busy or label %s is not known\n",
 						id, label);
 		return -EINVAL;
 	}
+	idr_remove(&chrdev_idr, id);
+	mutex_unlock(&chrdev_idr_lock);
 
-	/* Stop the timer */
-	hrtimer_cancel(&chrdev->timer);
+	/* Stop the data source; from now on nobody can restart it */
+	chrdev_set_source(chrdev, NULL);
 
-	/* Deinit the chrdev data */
-	chrdev->id = 0;
-	chrdev->busy = 0;
+	dev_info(&chrdev->dev, "chrdev %s with id %d removed\n", label, id);
 
-	dev_info(chrdev->dev, "chrdev %s with id %d removed\n", label, id);
-
-	/* Free allocated memory */
-	kfree(chrdev->buf);
-
-	/* Dealocate the device */
-	device_destroy(chrdev_class, chrdev->dev->devt);
-	cdev_del(&chrdev->cdev);
+	/* Dealocate the device; memory is freed by chrdev_dev_release()
+	 * as soon as the last open file is closed.
+	 */
+	debugfs_remove_recursive(chrdev->debugfs);
+	cdev_device_del(&chrdev->cdev, &chrdev->dev);
+	put_device(&chrdev->dev);
 
 	return 0;
 }
@@ -369,9 +2236,10 @@ static int __init chrdev_init(void)
 		pr_err("chrdev: failed to allocate class\n");
 		return -ENOMEM;
 	}
+	chrdev_class->dev_groups = chrdev_groups;
 
 	/* Allocate a region for character devices */
-	ret = alloc_chrdev_region(&chrdev_devt, 0, MAX_DEVICES, "chrdev");
+	ret = alloc_chrdev_region(&chrdev_devt, 0, max_devices, "chrdev");
 	if (ret < 0) {
 		pr_err("failed to allocate char device region\n");
 		goto remove_class;
@@ -379,6 +2247,9 @@ static int __init chrdev_init(void)
 
 	pr_info("got major %d\n", MAJOR(chrdev_devt));
 
+	/* Create the debugfs directory for the devices' statistics */
+	chrdev_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
 	return 0;
 
 remove_class:
@@ -389,8 +2260,10 @@ remove_class:
 
 static void __exit chrdev_exit(void)
 {
-	unregister_chrdev_region(chrdev_devt, MAX_DEVICES);
+	debugfs_remove_recursive(chrdev_debugfs_root);
+	unregister_chrdev_region(chrdev_devt, max_devices);
 	class_destroy(chrdev_class);
+	idr_destroy(&chrdev_idr);
 }
 
 module_init(chrdev_init);
@@ -3,37 +3,178 @@
  */
 
 #include <linux/cdev.h>
+#include <linux/percpu.h>
 #include <linux/circ_buf.h>
 #include <linux/mutex.h>
-#include <linux/hrtimer.h>
 #include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include "chrdev_ioctl.h"
+
+#define MAX_DEVICES	8	/* default number of minors */
+#define NAME_LEN	CHRDEV_NAME_LEN
+#define DEF_BUF_LEN	PAGE_SIZE
+#define MAX_CATCH_UP	16	/* missed periods produced at each tick */
 
-#define MAX_DEVICES	8
-#define NAME_LEN	32
-#define BUF_LEN		PAGE_SIZE
+/* Bits into chrdev_device->flags */
+#define CHRDEV_THROTTLED	0	/* the producer is stopped */
 
 /*
  * Chrdev basic structs
  */
 
-/* Main struct */
+/* Performance counters (all u64, kept per CPU) */
+struct chrdev_stats {
+	u64 read_bytes;
+	u64 read_calls;
+	u64 short_reads;
+	u64 eagain;
+	u64 drops;		/* bytes, or records in record mode */
+	u64 wakeups;
+	u64 wait_ns;
+	u64 mmap_faults;
+	u64 overruns;		/* missed timer periods */
+};
+
+#define chrdev_stat_inc(chrdev, name)	this_cpu_inc((chrdev)->stats->name)
+#define chrdev_stat_add(chrdev, name, n) this_cpu_add((chrdev)->stats->name, n)
+
+/* Latency histograms (kept per CPU): bucket i counts the delays into
+ * [2^i, 2^(i + 1)) ns, while bucket 0 counts the ones under 2 ns too
+ */
+#define CHRDEV_LAT_BUCKETS	32
+
+enum chrdev_lat_type {
+	CHRDEV_LAT_JITTER,	/* timer expiration to handler */
+	CHRDEV_LAT_PRODUCE,	/* data production to readers' wakeup */
+	CHRDEV_LAT_WAKEUP,	/* readers' wakeup to data copy */
+	CHRDEV_LAT_NR,
+};
+
+struct chrdev_latency {
+	u64 hist[CHRDEV_LAT_NR][CHRDEV_LAT_BUCKETS];
+};
+
+static inline unsigned int chrdev_lat_bucket(u64 ns)
+{
+	return ns < 2 ? 0 : min_t(unsigned int, ilog2(ns),
+					CHRDEV_LAT_BUCKETS - 1);
+}
+
+#define chrdev_lat_add(chrdev, type, ns)				\
+	this_cpu_inc((chrdev)->latency->hist[type][chrdev_lat_bucket(ns)])
+
+struct chrdev_device;
+
+/* Data source operations, called with source_lock held */
+struct chrdev_source_ops {
+	const char *name;
+	int (*start)(struct chrdev_device *chrdev);
+	void (*stop)(struct chrdev_device *chrdev);
+	void (*kick)(struct chrdev_device *chrdev);	/* NULL if unstoppable */
+};
+
+/* Shared tick: a single hrtimer feeding all the devices using the timer
+ * source with the same period on the same CPU.
+ */
+struct chrdev_tick {
+	struct hrtimer timer;
+	struct list_head list;		/* into the ticks list */
+	spinlock_t lock;
+	struct list_head devices;	/* running devices */
+	struct chrdev_device *running;	/* the one the handler is serving */
+	bool armed;
+	unsigned int users;		/* attached devices, even if throttled */
+	u64 period_ns;
+	enum hrtimer_mode mode;
+	int cpu;
+};
+
+/* Main struct
+ *
+ * Fields are grouped by who writes them, and each group starts on its
+ * own cache line, so that the producer publishing head does not steal
+ * the lines the consumers keep reading and vice versa. On 64-bit
+ * systems without lock debugging the producer and the wakeup groups
+ * fit into a single cache line each; keep them so.
+ */
 struct chrdev_device {
+	/* Read-mostly data, written at registration or by sysfs */
 	char label[NAME_LEN];
-	unsigned int busy : 1;
 	char *buf;
-	size_t head, tail;
+	size_t buf_len;
+	struct page **pages;	/* data pages and then timestamps pages */
+	unsigned int nr_pages;
+	unsigned int nr_ts_pages;
+	struct chrdev_tstamp *ts;
+	unsigned int ts_nr;
+	struct page *ctrl_page;
+	struct chrdev_ring_ctrl *ctrl;
+	int policy;
+	int mode;
+	clockid_t clock;
+	int cpu;		/* producer's CPU or -1 */
+	int node;		/* buffer's NUMA node or NUMA_NO_NODE */
 	int read_only;
-
 	unsigned int id;
-	struct module *owner;
-	struct cdev cdev;
-	struct device *dev;
+	struct chrdev_stats __percpu *stats;
+	struct chrdev_latency __percpu *latency;
+	const struct chrdev_source_ops *source;
+	u64 delay_ns;		/* timer source's period */
+
+	/* Producer data, written at each run of the producer */
+	size_t head ____cacheline_aligned_in_smp;
+	u32 tail;		/* slowest reader's cursor */
+	u32 seq;		/* next record's sequence number */
+	unsigned long flags;
+	spinlock_t files_lock;
+	unsigned int next_char;	/* into the generated sequence */
+	struct list_head files;
+	struct chrdev_file *ctrl_owner;
 
-	struct mutex mux;
-	struct spinlock lock;
+	/* Wakeup data, written by the producer when it wakes the readers
+	 * up and by the readers when they sleep or ask for signals
+	 */
+	u64 wake_ns ____cacheline_aligned_in_smp; /* last readers' wakeup */
 	struct wait_queue_head queue;
-	struct hrtimer timer;
 	struct fasync_struct *fasync_queue;
+
+	/* Device management data, used at open()/release() and when the
+	 * data source is started, stopped or throttled
+	 */
+	struct module *owner ____cacheline_aligned_in_smp;
+	struct mutex source_lock;
+	struct work_struct kick_work;	/* nowait unthrottle */
+	struct chrdev_tick *tick;
+	struct list_head tick_list;
+	struct task_struct *thread;
+	int gpio;
+	int irq;
+	struct dentry *debugfs;	/* our debugfs directory */
+	struct cdev cdev;
+	struct device dev;
+};
+
+/* Per open file data: each reader has its own cursor into the ring. The
+ * fields updated by the producer are kept apart from the reader's ones.
+ */
+struct chrdev_file {
+	struct chrdev_device *chrdev;
+	struct list_head list;
+	size_t lowat;
+	u64 timeout_ns;
+
+	/* Reader data */
+	struct mutex mux ____cacheline_aligned_in_smp;
+	u32 tail;
+	u32 *cursor;		/* &tail or &ctrl->tail if we own the ctrl page */
+	u64 consumed;
+	u64 wake_ns;		/* last wakeup accounted into the histograms */
+
+	/* Producer data */
+	u64 pending_since ____cacheline_aligned_in_smp;
+	u64 lost;
 };
 
 /*
@@ -44,6 +185,6 @@ struct chrdev_device {
 #define to_chrdev_device(obj) container_of((obj), struct chrdev_device, class)
 
 extern int chrdev_device_register(const char *label, unsigned int id,
-				unsigned int read_only,
+				unsigned int read_only, size_t len,
 				struct module *owner, struct device *parent);
 extern int chrdev_device_unregister(const char *label, unsigned int id);
@@ -0,0 +1,49 @@
+/*
+ * Chrdev IRQ tracepoints include file
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chrdev_irq
+
+#if !defined(_CHRDEV_IRQ_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHRDEV_IRQ_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/*
+ * The latency is taken from start (or 0) which the caller sets only
+ * when the event is enabled; for blocking reads it includes the time
+ * spent waiting for data.
+ */
+
+TRACE_EVENT(chrdev_irq_read,
+	TP_PROTO(unsigned int id, size_t count, ssize_t ret, u64 start),
+	TP_ARGS(id, count, ret, start),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->latency = start ? ktime_get_ns() - start : 0;
+	),
+
+	TP_printk("id=%u count=%zu ret=%zd latency=%lluns",
+		  __entry->id, __entry->count, __entry->ret, __entry->latency)
+);
+
+#endif /* _CHRDEV_IRQ_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chrdev_irq_trace
+#include <trace/define_trace.h>
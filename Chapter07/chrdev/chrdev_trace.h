@@ -0,0 +1,115 @@
+/*
+ * Chrdev tracepoints include file
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chrdev
+
+#if !defined(_CHRDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHRDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/*
+ * All events carry the latency of the method in ns; callers pass the
+ * start time (or 0) taken only when the event is enabled, so nothing
+ * is paid on the hot path otherwise.
+ */
+
+DECLARE_EVENT_CLASS(chrdev_io,
+	TP_PROTO(unsigned int id, size_t count, loff_t pos,
+		 ssize_t ret, u64 start),
+	TP_ARGS(id, count, pos, ret, start),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(size_t, count)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->count = count;
+		__entry->pos = pos;
+		__entry->ret = ret;
+		__entry->latency = start ? ktime_get_ns() - start : 0;
+	),
+
+	TP_printk("id=%u count=%zu pos=%lld ret=%zd latency=%lluns",
+		  __entry->id, __entry->count, __entry->pos,
+		  __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(chrdev_io, chrdev_read,
+	TP_PROTO(unsigned int id, size_t count, loff_t pos,
+		 ssize_t ret, u64 start),
+	TP_ARGS(id, count, pos, ret, start)
+);
+
+DEFINE_EVENT(chrdev_io, chrdev_write,
+	TP_PROTO(unsigned int id, size_t count, loff_t pos,
+		 ssize_t ret, u64 start),
+	TP_ARGS(id, count, pos, ret, start)
+);
+
+TRACE_EVENT(chrdev_llseek,
+	TP_PROTO(unsigned int id, loff_t offset, int whence,
+		 loff_t ret, u64 start),
+	TP_ARGS(id, offset, whence, ret, start),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(loff_t, offset)
+		__field(int, whence)
+		__field(loff_t, ret)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->offset = offset;
+		__entry->whence = whence;
+		__entry->ret = ret;
+		__entry->latency = start ? ktime_get_ns() - start : 0;
+	),
+
+	TP_printk("id=%u offset=%lld whence=%d ret=%lld latency=%lluns",
+		  __entry->id, __entry->offset, __entry->whence,
+		  __entry->ret, __entry->latency)
+);
+
+TRACE_EVENT(chrdev_ioctl,
+	TP_PROTO(unsigned int id, unsigned int cmd, long ret, u64 start),
+	TP_ARGS(id, cmd, ret, start),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->latency = start ? ktime_get_ns() - start : 0;
+	),
+
+	TP_printk("id=%u cmd=%x (nr=%d size=%d dir=%x) ret=%ld latency=%lluns",
+		  __entry->id, __entry->cmd, _IOC_NR(__entry->cmd),
+		  _IOC_SIZE(__entry->cmd), _IOC_DIR(__entry->cmd),
+		  __entry->ret, __entry->latency)
+);
+
+#endif /* _CHRDEV_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chrdev_trace
+#include <trace/define_trace.h>
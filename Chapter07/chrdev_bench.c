@@ -0,0 +1,334 @@
+/*
+ * chrdev saturation benchmark testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "chrdev_ioctl.h"
+
+enum strategy { BENCH_READ, BENCH_POLL, BENCH_FASYNC, BENCH_MMAP };
+
+static const char *strategy_names[] = {
+	[BENCH_READ]	= "read",
+	[BENCH_POLL]	= "poll",
+	[BENCH_FASYNC]	= "fasync",
+	[BENCH_MMAP]	= "mmap",
+};
+
+static int fd;
+static char *buf;
+static long len = 65536;
+static unsigned long long bytes, wakeups, lost;
+static const char *lost_unit = "bytes";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void get_lost(void)
+{
+	struct chrdev_ring_status status;
+	int ret;
+
+	ret = ioctl(fd, CHRDEV_IOC_RING_STATUS, &status);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_RING_STATUS)");
+		exit(EXIT_FAILURE);
+	}
+	lost = status.lost;
+}
+
+/* Losses are counted in records in record mode, which we read from
+ * the device's sysfs directory
+ */
+static void get_lost_unit(void)
+{
+	struct stat st;
+	char path[64], mode[16] = "";
+	FILE *f;
+	int ret;
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/mode",
+			major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%15s", mode) == 1)
+		lost_unit = strcmp(mode, "record") == 0 ? "records" : "bytes";
+	fclose(f);
+}
+
+/* Each time we sleep waiting for data we do a voluntary context
+ * switch, so these are our wakeups whatever the strategy is
+ */
+static void get_wakeups(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	wakeups = ru.ru_nvcsw;
+}
+
+/* Read until the ring is empty (non-blocking file) */
+static void drain(void)
+{
+	ssize_t ret;
+
+	while (1) {
+		ret = read(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		bytes += ret;
+	}
+}
+
+static void wait_poll(void)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	ret = poll(&pfd, 1, 1000);
+	if (ret < 0) {
+		perror("poll");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Return how many bytes from tail we can give back to the producer.
+ * In record mode these must be whole records, whose lengths we read
+ * from the ring; with the drop-oldest policy they may be garbage, but
+ * then the following compare-and-swap on tail fails.
+ */
+static __u32 mmap_avail(struct chrdev_ring_ctrl *ctrl, const char *data,
+				__u32 head, __u32 tail)
+{
+	const struct chrdev_record *rec;
+	__u32 mask = ctrl->size - 1;
+	__u32 n = (head - tail) & mask;
+	__u32 off, len;
+
+	if (__atomic_load_n(&ctrl->mode, __ATOMIC_RELAXED) !=
+						CHRDEV_MODE_RECORD)
+		return n;
+
+	for (off = 0; off < n; off += len) {
+		rec = (const struct chrdev_record *) &data[(tail + off) & mask];
+		len = CHRDEV_RECORD_SIZE(__atomic_load_n(&rec->len,
+						__ATOMIC_RELAXED));
+		if (len > n - off)
+			break;
+	}
+
+	return off;
+}
+
+static void setup_fasync(sigset_t *set)
+{
+	long flags;
+	int ret;
+
+	/* SIGIO is blocked and collected by sigtimedwait() */
+	sigemptyset(set);
+	sigaddset(set, SIGIO);
+	sigprocmask(SIG_BLOCK, set, NULL);
+
+	ret = fcntl(fd, F_SETOWN, getpid());
+	if (ret < 0) {
+		perror("fcntl(..., F_SETOWN, ...)");
+		exit(EXIT_FAILURE);
+	}
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		perror("fcntl(..., F_GETFL)");
+		exit(EXIT_FAILURE);
+	}
+	ret = fcntl(fd, F_SETFL, flags | FASYNC);
+	if (ret < 0) {
+		perror("fcntl(..., F_SETFL, ...)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	enum strategy strategy = BENCH_READ;
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct chrdev_ring_ctrl *ctrl = NULL;
+	struct timespec timeout = { 1, 0 };
+	char *data = NULL;
+	unsigned long long last_bytes = 0, last_wakeups = 0, last_lost = 0;
+	double start, last, t;
+	unsigned long long start_wakeups;
+	int secs = 10;
+	__u32 head, tail, n;
+	sigset_t set;
+	int i, flags, ret;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <dev> read|poll|fasync|mmap "
+				"[<secs> [<len>]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i <= BENCH_MMAP; i++)
+		if (strcmp(argv[2], strategy_names[i]) == 0)
+			break;
+	if (i > BENCH_MMAP) {
+		fprintf(stderr, "invalid strategy %s\n", argv[2]);
+		exit(EXIT_FAILURE);
+	}
+	strategy = i;
+	if (argc > 3)
+		secs = atoi(argv[3]);
+	if (argc > 4)
+		len = atol(argv[4]);
+
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The mmap strategy writes the control page, which needs write
+	 * access to the device
+	 */
+	flags = strategy == BENCH_MMAP ? O_RDWR : O_RDONLY;
+	if (strategy != BENCH_READ)
+		flags |= O_NONBLOCK;
+	ret = open(argv[1], flags);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened (strategy %s)\n", argv[1], argv[2]);
+	fd = ret;
+
+	if (strategy == BENCH_FASYNC)
+		setup_fasync(&set);
+	if (strategy == BENCH_MMAP) {
+		ctrl = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (ctrl == MAP_FAILED) {
+			perror("mmap(ctrl)");
+			exit(EXIT_FAILURE);
+		}
+		data = mmap(NULL, ctrl->size, PROT_READ,
+				MAP_SHARED, fd, page_size);
+		if (data == MAP_FAILED) {
+			perror("mmap(data)");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Consume data as fast as we can and report every second */
+	get_wakeups();
+	start_wakeups = last_wakeups = wakeups;
+	start = last = now();
+	do {
+		switch (strategy) {
+		case BENCH_READ:
+			ret = read(fd, buf, len);
+			if (ret < 0) {
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+			bytes += ret;
+			break;
+
+		case BENCH_POLL:
+			wait_poll();
+			drain();
+			break;
+
+		case BENCH_FASYNC:
+			ret = sigtimedwait(&set, NULL, &timeout);
+			if (ret < 0 && errno != EAGAIN) {
+				perror("sigtimedwait");
+				exit(EXIT_FAILURE);
+			}
+			drain();
+			break;
+
+		case BENCH_MMAP:
+			/* Wait only when the ring is empty, then just
+			 * give all the data back without copying them. If
+			 * the producer moved tail meanwhile (drop-oldest
+			 * policy) we have lost these data.
+			 */
+			head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+			tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+			n = mmap_avail(ctrl, data, head, tail);
+			if (!n) {
+				wait_poll();
+				break;
+			}
+			if (__atomic_compare_exchange_n(&ctrl->tail, &tail,
+						tail + n, 0, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+				bytes += n;
+			break;
+		}
+
+		t = now();
+		if (t - last >= 1.0) {
+			get_lost();
+			get_lost_unit();
+			get_wakeups();
+			printf("%.0f bytes/s, %.0f wakeups/s, %llu %s lost\n",
+				(bytes - last_bytes) / (t - last),
+				(wakeups - last_wakeups) / (t - last),
+				lost - last_lost, lost_unit);
+			last_bytes = bytes;
+			last_wakeups = wakeups;
+			last_lost = lost;
+			last = t;
+		}
+	} while (t - start < secs);
+
+	get_lost();
+	get_lost_unit();
+	get_wakeups();
+	wakeups -= start_wakeups;
+	printf("total %llu bytes, %llu wakeups, %llu %s lost in %.1fs: "
+			"%.0f bytes/s, %.0f wakeups/s\n",
+			bytes, wakeups, lost, lost_unit, t - start,
+			bytes / (t - start), wakeups / (t - start));
+
+	if (strategy == BENCH_MMAP) {
+		munmap(data, ctrl->size);
+		munmap(ctrl, page_size);
+	}
+	close(fd);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * chrdev bulk ioctl() testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "chrdev_ioctl.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	char name[16] = "chrdev", check[16];
+	__u32 version = 1, check_version;
+	__u64 counter = 0;
+	struct chrdev_seg segs[] = {
+		{ .offset = 0, .len = sizeof(name) },
+		{ .offset = 64, .len = sizeof(version) },
+	};
+	struct chrdev_bulk bulk = {
+		.segs = (__u64) (unsigned long) segs,
+		.nr_segs = ARRAY_SIZE(segs),
+	};
+	struct chrdev_fill fill = {
+		.offset = 128,
+		.len = 64,
+		.value = 0,
+	};
+	struct chrdev_cas cas = {
+		.offset = 256,
+	};
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	ret = open(argv[1], O_RDWR);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	/* Write two fields at once... */
+	segs[0].addr = (__u64) (unsigned long) name;
+	segs[1].addr = (__u64) (unsigned long) &version;
+	ret = ioctl(fd, CHRDEV_IOC_WRITEV, &bulk);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_WRITEV)");
+		exit(EXIT_FAILURE);
+	}
+	printf("wrote %d bytes\n", ret);
+
+	/* ... and read them back */
+	segs[0].addr = (__u64) (unsigned long) check;
+	segs[1].addr = (__u64) (unsigned long) &check_version;
+	ret = ioctl(fd, CHRDEV_IOC_READV, &bulk);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_READV)");
+		exit(EXIT_FAILURE);
+	}
+	printf("read %d bytes: name=%s version=%u\n",
+			ret, check, check_version);
+
+	/* Clear a range */
+	ret = ioctl(fd, CHRDEV_IOC_FILL, &fill);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_FILL)");
+		exit(EXIT_FAILURE);
+	}
+	printf("cleared %llu bytes at %llu\n", (unsigned long long) fill.len,
+			(unsigned long long) fill.offset);
+
+	/* Increment a counter as concurrent users would do */
+	do {
+		cas.old = counter;
+		cas.new = counter + 1;
+		ret = ioctl(fd, CHRDEV_IOC_CAS64, &cas);
+		counter = cas.old;
+	} while (ret < 0 && errno == EAGAIN);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_CAS64)");
+		exit(EXIT_FAILURE);
+	}
+	printf("counter at %llu is now %llu\n", (unsigned long long) cas.offset,
+			(unsigned long long) counter + 1);
+
+	close(fd);
+
+	return 0;
+}
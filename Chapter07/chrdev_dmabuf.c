@@ -0,0 +1,91 @@
+/*
+ * chrdev dma-buf export testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+
+#include "chrdev_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	struct chrdev_dmabuf dmabuf = { 0 };
+	struct dma_buf_sync sync = { 0 };
+	long len = 64;
+	off_t size;
+	char *addr, *buf;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev> [<len>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (argc > 2)
+		len = atol(argv[2]);
+
+	ret = open(argv[1], O_RDONLY);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		perror("lseek");
+		exit(EXIT_FAILURE);
+	}
+	if (len > size)
+		len = size;
+
+	/* Get a dma-buf for the active buffer and map it */
+	ret = ioctl(fd, CHRDEV_IOC_EXPORT_DMABUF, &dmabuf);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_EXPORT_DMABUF)");
+		exit(EXIT_FAILURE);
+	}
+	printf("got dma-buf fd=%d\n", dmabuf.fd);
+
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, dmabuf.fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The dma-buf and the device must show the same data */
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	ret = pread(fd, buf, len, 0);
+	if (ret < 0) {
+		perror("pread");
+		exit(EXIT_FAILURE);
+	}
+
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+	ioctl(dmabuf.fd, DMA_BUF_IOCTL_SYNC, &sync);
+	printf("dma-buf data %s device data\n",
+			memcmp(addr, buf, ret) ? "differ from" : "match");
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	ioctl(dmabuf.fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+	munmap(addr, size);
+	close(dmabuf.fd);
+	close(fd);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * chrdev concurrent readers testing program
+ *
+ * Readers read the same len bytes over and over while writers keep
+ * rewriting them with a single repeated byte, so a read holding mixed
+ * bytes is a torn one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "chrdev_ioctl.h"
+
+static const char *dev;
+static long len = 4096;
+static volatile int stop;
+
+/* Counters are updated into local variables and stored here at exit
+ * only, so that workers do not bounce each other's cache lines
+ */
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long long bytes, calls, torn;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_dev(int flags)
+{
+	int fd;
+
+	fd = open(dev, flags);
+	if (fd < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static char *alloc_buf(void)
+{
+	char *buf;
+
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	return buf;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	int fd = open_dev(O_RDONLY);
+	char *buf = alloc_buf();
+	unsigned long long bytes = 0, calls = 0, torn = 0;
+	ssize_t ret, i;
+
+	while (!stop) {
+		ret = pread(fd, buf, len, 0);
+		if (ret < 0) {
+			perror("pread");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 1; i < ret; i++)
+			if (buf[i] != buf[0]) {
+				torn++;
+				break;
+			}
+		bytes += ret;
+		calls++;
+	}
+	w->bytes = bytes;
+	w->calls = calls;
+	w->torn = torn;
+
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct worker *w = arg;
+	int fd = open_dev(O_WRONLY);
+	char *buf = alloc_buf();
+	unsigned long long bytes = 0, calls = 0;
+	ssize_t ret;
+	char c = 'A' + w->id;
+
+	while (!stop) {
+		memset(buf, c, len);
+		ret = pwrite(fd, buf, len, 0);
+		if (ret < 0) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+		bytes += ret;
+		calls++;
+		c = c == 'Z' ? 'A' : c + 1;
+	}
+	w->bytes = bytes;
+	w->calls = calls;
+
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int readers = 1, writers = 0, secs = 10;
+	unsigned long long bytes = 0, torn = 0;
+	struct worker *w;
+	double start, t;
+	int i, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev> [<readers> [<writers> "
+				"[<secs> [<len>]]]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	dev = argv[1];
+	if (argc > 2)
+		readers = atoi(argv[2]);
+	if (argc > 3)
+		writers = atoi(argv[3]);
+	if (argc > 4)
+		secs = atoi(argv[4]);
+	if (argc > 5)
+		len = atol(argv[5]);
+	if (readers < 1 || writers < 0) {
+		fprintf(stderr, "invalid number of readers or writers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Longer writes are split, so they would be torn for sure */
+	if (len < 1 || (writers && len > CHRDEV_ATOMIC_MAX)) {
+		fprintf(stderr, "invalid len (at most %d with writers)\n",
+				CHRDEV_ATOMIC_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	w = calloc(readers + writers, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Start all the threads at once and let them run for secs */
+	start = now();
+	for (i = 0; i < readers + writers; i++) {
+		w[i].id = i;
+		ret = pthread_create(&w[i].thread, NULL,
+				i < readers ? reader : writer, &w[i]);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	sleep(secs);
+	stop = 1;
+	for (i = 0; i < readers + writers; i++)
+		pthread_join(w[i].thread, NULL);
+	t = now() - start;
+
+	for (i = 0; i < readers + writers; i++) {
+		printf("%s %d: %.0f bytes/s, %.0f calls/s",
+			i < readers ? "reader" : "writer", w[i].id,
+			w[i].bytes / t, w[i].calls / t);
+		if (i < readers) {
+			printf(", %llu torn reads", w[i].torn);
+			bytes += w[i].bytes;
+			torn += w[i].torn;
+		}
+		printf("\n");
+	}
+	printf("total %d readers: %.0f bytes/s (%.0f bytes/s per reader), "
+			"%llu torn reads\n",
+			readers, bytes / t, bytes / t / readers, torn);
+
+	free(w);
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * chrdev record mode testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "chrdev_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	char *buf;
+	long len = 4096;
+	struct chrdev_record *rec;
+	__u32 seq = 0;
+	int first = 1;
+	ssize_t n, pos;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev> [<len>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (argc > 2)
+		len = atol(argv[2]);
+
+	/* Records are 8 bytes aligned into the user buffer too */
+	ret = posix_memalign((void **) &buf, CHRDEV_RECORD_ALIGN, len);
+	if (ret) {
+		errno = ret;
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = open(argv[1], O_RDONLY);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	while (1) {
+		/* Each read() returns whole records only */
+		n = read(fd, buf, len);
+		if (n < 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+
+		for (pos = 0; pos < n; pos += CHRDEV_RECORD_SIZE(rec->len)) {
+			rec = (struct chrdev_record *) &buf[pos];
+
+			if (!first && rec->seq != seq)
+				printf("lost %u records\n", rec->seq - seq);
+			first = 0;
+			seq = rec->seq + 1;
+
+			printf("seq=%u ts=%llu len=%u '%.*s'\n",
+				rec->seq, (unsigned long long) rec->timestamp,
+				rec->len, (int) rec->len, (char *) (rec + 1));
+		}
+	}
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}
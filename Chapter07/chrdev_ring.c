@@ -0,0 +1,103 @@
+/*
+ * chrdev mmap()ed ring testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "chrdev_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct chrdev_ring_ctrl *ctrl;
+	struct chrdev_tstamp *ts, *last;
+	struct pollfd pfd;
+	char *data;
+	__u32 head, tail, mask, seq;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The control page is mapped shared and writable, so we need
+	 * write access even if the device itself cannot be written
+	 */
+	ret = open(argv[1], O_RDWR);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	/* Map the control page and then the data area read-only */
+	ctrl = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (ctrl == MAP_FAILED) {
+		perror("mmap(ctrl)");
+		exit(EXIT_FAILURE);
+	}
+	data = mmap(NULL, ctrl->size, PROT_READ,
+			MAP_SHARED, fd, page_size);
+	if (data == MAP_FAILED) {
+		perror("mmap(data)");
+		exit(EXIT_FAILURE);
+	}
+	ts = mmap(NULL, ctrl->ts_nr * sizeof(*ts), PROT_READ,
+			MAP_SHARED, fd, page_size + ctrl->size);
+	if (ts == MAP_FAILED) {
+		perror("mmap(ts)");
+		exit(EXIT_FAILURE);
+	}
+	mask = ctrl->size - 1;
+	printf("got ring of %u bytes\n", ctrl->size);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (1) {
+		/* Wait for new data only when the ring is empty */
+		head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+		seq = ctrl->seq;
+		tail = ctrl->tail;
+		if (head == (tail & mask)) {
+			ret = poll(&pfd, 1, -1);
+			if (ret < 0) {
+				perror("poll");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		/* Consume all available data and give the space back; tail
+		 * is a free-running counter, so it is masked on use only
+		 */
+		while ((tail & mask) != head) {
+			putchar(data[tail & mask]);
+			tail++;
+		}
+		__atomic_store_n(&ctrl->tail, tail, __ATOMIC_RELEASE);
+
+		/* Report when the newest data have been produced */
+		last = &ts[(seq - 1) % ctrl->ts_nr];
+		printf(" [%llu]\n", (unsigned long long) last->timestamp);
+		fflush(stdout);
+	}
+
+	munmap(ts, ctrl->ts_nr * sizeof(*ts));
+	munmap(data, ctrl->size);
+	munmap(ctrl, page_size);
+	close(fd);
+
+	return 0;
+}
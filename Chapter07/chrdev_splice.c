@@ -0,0 +1,81 @@
+/*
+ * chrdev splice() testing program
+ *
+ * It records the device's data into a file without copying them into
+ * user space: data go from the device into a pipe and then from the
+ * pipe into the file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+int main(int argc, char *argv[])
+{
+	int fd, out, pfd[2];
+	long len = 65536;
+	unsigned long long total = 0;
+	ssize_t n, ret;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <dev> <file> [<len>]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (argc > 3)
+		len = atol(argv[3]);
+
+	ret = open(argv[1], O_RDONLY);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	ret = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	out = ret;
+
+	ret = pipe(pfd);
+	if (ret < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Move data until the end of the device (if any) */
+	while (1) {
+		n = splice(fd, NULL, pfd[1], NULL, len, SPLICE_F_MOVE);
+		if (n < 0) {
+			perror("splice(dev)");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0)
+			break;
+
+		while (n > 0) {
+			ret = splice(pfd[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+			if (ret < 0) {
+				perror("splice(file)");
+				exit(EXIT_FAILURE);
+			}
+			n -= ret;
+			total += ret;
+		}
+	}
+	printf("%llu bytes recorded into %s\n", total, argv[2]);
+
+	close(pfd[0]);
+	close(pfd[1]);
+	close(out);
+	close(fd);
+
+	return 0;
+}
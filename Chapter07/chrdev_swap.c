@@ -0,0 +1,91 @@
+/*
+ * chrdev double buffering testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "chrdev_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	off_t size, offset;
+	size_t len;
+	char *buf;
+	__u64 gen;
+	int ret;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: %s <dev> <offset> <text>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	offset = atol(argv[2]);
+	len = strlen(argv[3]);
+
+	ret = open(argv[1], O_RDWR);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	/* The shadow buffer starts where the active one ends */
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		perror("lseek");
+		exit(EXIT_FAILURE);
+	}
+	ret = ioctl(fd, CHRDEV_IOC_GET_GEN, &gen);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_GET_GEN)");
+		exit(EXIT_FAILURE);
+	}
+	printf("buffer is %ld bytes long at generation %llu\n",
+			(long) size, (unsigned long long) gen);
+
+	/* Start from the current content and change the text only... */
+	ret = ioctl(fd, CHRDEV_IOC_SNAPSHOT);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_SNAPSHOT)");
+		exit(EXIT_FAILURE);
+	}
+	ret = pwrite(fd, argv[3], len, size + offset);
+	if (ret < 0) {
+		perror("pwrite");
+		exit(EXIT_FAILURE);
+	}
+
+	/* ... then publish it */
+	ret = ioctl(fd, CHRDEV_IOC_COMMIT, &gen);
+	if (ret < 0) {
+		perror("ioctl(CHRDEV_IOC_COMMIT)");
+		exit(EXIT_FAILURE);
+	}
+	printf("committed generation %llu\n", (unsigned long long) gen);
+
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	ret = pread(fd, buf, len, offset);
+	if (ret < 0) {
+		perror("pread");
+		exit(EXIT_FAILURE);
+	}
+	printf("read back '%.*s'\n", ret, buf);
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}
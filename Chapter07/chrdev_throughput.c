@@ -0,0 +1,82 @@
+/*
+ * chrdev read() throughput testing program
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	char *buf;
+	long len = 4096;
+	int secs = 10;
+	unsigned long long bytes = 0, calls = 0;
+	double start, last, t;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dev> [<secs> [<len>]]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (argc > 2)
+		secs = atoi(argv[2]);
+	if (argc > 3)
+		len = atol(argv[3]);
+
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = open(argv[1], O_RDONLY);
+	if (ret < 0) {
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	printf("file %s opened\n", argv[1]);
+	fd = ret;
+
+	/* Read as fast as we can and report the rate every second */
+	start = last = now();
+	do {
+		ret = read(fd, buf, len);
+		if (ret < 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		bytes += ret;
+		calls++;
+
+		t = now();
+		if (t - last >= 1.0) {
+			printf("%.0f bytes/s (%.1f bytes/read)\n",
+					bytes / (t - start),
+					(double) bytes / calls);
+			last = t;
+		}
+	} while (t - start < secs);
+
+	printf("total %llu bytes in %llu reads, %.0f bytes/s\n",
+			bytes, calls, bytes / (t - start));
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}